@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+void arena_init(struct arena *arena)
+{
+	memset(arena, 0, sizeof(struct arena));
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->first;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		munmap(chunk, chunk->size + ARENA_HEADER_SIZE);
+		chunk = next;
+	}
+	arena_init(arena);
+}
+
+static struct arena_chunk *arena_chunk_new(size_t size)
+{
+	size_t bytes = (size + ARENA_HEADER_SIZE + ARENA_CHUNK_SIZE - 1)
+		& ~(ARENA_CHUNK_SIZE - 1);
+	struct arena_chunk *chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+		abort();
+#ifdef MADV_HUGEPAGE
+	if (ARENA_HUGEPAGE)
+		madvise(chunk, bytes, MADV_HUGEPAGE);
+#endif
+	chunk->next = NULL;
+	chunk->size = bytes - ARENA_HEADER_SIZE;
+	return chunk;
+}
+
+/**
+ * slow path of arena_alloc(): move on to the next kept chunk that can hold
+ * `size`, mapping a new one at the tail when none is left.
+ */
+void *arena_grow(struct arena *arena, size_t size, size_t align)
+{
+	struct arena_chunk *chunk = arena->curr ? arena->curr->next
+		: arena->first;
+
+	while (chunk != NULL && chunk->size < size)
+		chunk = chunk->next;
+	if (chunk == NULL) {
+		chunk = arena_chunk_new(size);
+		if (arena->last != NULL)
+			arena->last->next = chunk;
+		else
+			arena->first = chunk;
+		arena->last = chunk;
+	}
+	arena->curr = chunk;
+	arena->ptr = arena_chunk_data(chunk);
+	arena->end = arena->ptr + chunk->size;
+	return arena_alloc(arena, size, align);
+}
@@ -0,0 +1,61 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* chunks are at least this big, a multiple of the huge page size */
+#define ARENA_CHUNK_SIZE (4UL << 20)
+/* ask for transparent huge pages behind the chunks */
+#define ARENA_HUGEPAGE 1
+/* room for the chunk header, keeps the data cache line aligned */
+#define ARENA_HEADER_SIZE 64
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size; /* usable bytes after the header */
+};
+
+/**
+ * bump allocator for the scratch memory of one document. a reset rewinds to
+ * the first chunk and keeps them all, so a worker stops mapping memory once
+ * it has seen its largest document. nothing is freed one by one.
+ */
+struct arena {
+	struct arena_chunk *first;
+	struct arena_chunk *last;
+	struct arena_chunk *curr;
+	char *ptr;
+	char *end;
+};
+
+void arena_init(struct arena *arena);
+void arena_destroy(struct arena *arena);
+void *arena_grow(struct arena *arena, size_t size, size_t align);
+
+static inline char *arena_chunk_data(struct arena_chunk *chunk)
+{
+	return (char *) chunk + ARENA_HEADER_SIZE;
+}
+
+/* `align` is a power of two no larger than ARENA_HEADER_SIZE */
+static inline void *arena_alloc(struct arena *arena, size_t size,
+				size_t align)
+{
+	char *p = (char *) (((unsigned long) arena->ptr + align - 1)
+			    & ~(align - 1));
+	if (arena->ptr == NULL || size > (size_t) (arena->end - p))
+		return arena_grow(arena, size, align);
+	arena->ptr = p + size;
+	return p;
+}
+
+static inline void arena_reset(struct arena *arena)
+{
+	arena->curr = arena->first;
+	if (arena->first == NULL)
+		return;
+	arena->ptr = arena_chunk_data(arena->first);
+	arena->end = arena->ptr + arena->first->size;
+}
+
+#endif /* _ARENA_H_ */
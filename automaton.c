@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "automaton.h"
+#include "hashtable.h"
+
+/* room for the rows of words up to MAX_WORD_LENGTH */
+typedef u8 lev_row_t[MAX_WORD_LENGTH + 1];
+
+#define LEV_HASHTABLE_CAP 4093
+
+static unsigned long lev_row_hash(const void *p)
+{
+	const u64 *row = p;
+	unsigned long h = row[0];
+	h = h * 31 + row[1];
+	h = h * 31 + row[2];
+	h = h * 31 + row[3];
+	return h;
+}
+
+static int lev_row_compare(const void *p, const void *q)
+{
+	return memcmp(p, q, sizeof(lev_row_t));
+}
+
+struct lev_builder {
+	struct lev_automaton *dfa;
+	struct hashtable *index;
+	lev_row_t *rows;
+	int cap;
+};
+
+/* look up the state of a row, creating it if needed */
+static int lev_builder_state(struct lev_builder *b, lev_row_t row, int len)
+{
+	struct lev_automaton *dfa = b->dfa;
+	int *id = hashtable_search(b->index, row);
+	int i = 0, min = 0;
+
+	if (id != NULL)
+		return *id;
+	if (dfa->nr_states == LEV_MAX_STATES)
+		return -1;
+	if (dfa->nr_states == b->cap) {
+		b->cap *= 2;
+		b->rows = realloc(b->rows, b->cap * sizeof(lev_row_t));
+		dfa->trans = realloc(dfa->trans, b->cap * dfa->nr_classes
+				     * sizeof(u16));
+		dfa->dist = realloc(dfa->dist, b->cap);
+		dfa->min = realloc(dfa->min, b->cap);
+	}
+	memcpy(b->rows[dfa->nr_states], row, sizeof(lev_row_t));
+	min = row[0];
+	for (i = 1; i <= len; i++)
+		min = row[i] < min ? row[i] : min;
+	dfa->dist[dfa->nr_states] = row[len];
+	dfa->min[dfa->nr_states] = min;
+	hashtable_insert(b->index, row, &dfa->nr_states);
+	return dfa->nr_states++;
+}
+
+struct lev_automaton *lev_automaton_new(const char *word, int len,
+					int max_dist)
+{
+	struct lev_automaton *dfa = malloc(sizeof(struct lev_automaton));
+	struct lev_builder b;
+	lev_row_t row, next;
+	int cap = max_dist + 1;
+	int s = 0, c = 0, i = 0;
+
+	/* letters of the word get their own class, the rest share class 0 */
+	memset(dfa->classes, 0, sizeof(dfa->classes));
+	dfa->nr_classes = 1;
+	for (i = 0; i < len; i++) {
+		if (dfa->classes[word[i] - 'a'] == 0)
+			dfa->classes[word[i] - 'a'] = dfa->nr_classes++;
+	}
+	dfa->nr_states = 0;
+	b.dfa = dfa;
+	b.cap = 64;
+	b.rows = malloc(b.cap * sizeof(lev_row_t));
+	b.index = hashtable_new(sizeof(lev_row_t), sizeof(int),
+				LEV_HASHTABLE_CAP, lev_row_hash,
+				lev_row_compare);
+	dfa->trans = malloc(b.cap * dfa->nr_classes * sizeof(u16));
+	dfa->dist = malloc(b.cap);
+	dfa->min = malloc(b.cap);
+
+	memset(row, 0, sizeof(lev_row_t));
+	memset(row, cap, len + 1);
+	lev_builder_state(&b, row, len);
+	for (i = 0; i <= len; i++)
+		row[i] = i < cap ? i : cap;
+	lev_builder_state(&b, row, len);
+
+	/* breadth first, states are numbered in discovery order */
+	for (s = 0; s < dfa->nr_states; s++) {
+		for (c = 0; c < dfa->nr_classes; c++) {
+			int id = 0;
+			memcpy(row, b.rows[s], sizeof(lev_row_t));
+			memset(next, 0, sizeof(lev_row_t));
+			next[0] = row[0] + 1 < cap ? row[0] + 1 : cap;
+			for (i = 1; i <= len; i++) {
+				int match = c != 0
+					&& dfa->classes[word[i - 1] - 'a'] == c;
+				int d = row[i] + 1;
+				if (next[i - 1] + 1 < d)
+					d = next[i - 1] + 1;
+				if (row[i - 1] + !match < d)
+					d = row[i - 1] + !match;
+				next[i] = d < cap ? d : cap;
+			}
+			id = lev_builder_state(&b, next, len);
+			if (id < 0) {
+				/* too many states, the caller falls back to
+				 * the bit-parallel kernel */
+				hashtable_destroy(b.index);
+				free(b.rows);
+				lev_automaton_destroy(dfa);
+				return NULL;
+			}
+			dfa->trans[s * dfa->nr_classes + c] = id;
+		}
+	}
+	hashtable_destroy(b.index);
+	free(b.rows);
+	return dfa;
+}
+
+void lev_automaton_destroy(struct lev_automaton *dfa)
+{
+	free(dfa->trans);
+	free(dfa->dist);
+	free(dfa->min);
+	free(dfa);
+}
@@ -0,0 +1,64 @@
+#ifndef _AUTOMATON_H_
+#define _AUTOMATON_H_
+
+#include "misc.h"
+#include "core.h"
+
+/* the automaton is dropped when a word needs more states than this */
+#define LEV_MAX_STATES (1 << 14)
+/* automata of all operators together stay below this many bytes */
+#define LEV_DFA_BUDGET (64 << 20)
+
+#define LEV_DEAD_STATE 0
+#define LEV_START_STATE 1
+
+/**
+ * deterministic levenshtein automaton of a word for thresholds up to
+ * max_dist. a state is a row of the edit distance DP with every entry capped
+ * at max_dist + 1, and letters are folded into classes: one per distinct
+ * letter of the word plus class 0 for everything else.
+ *
+ * @trans transition table, nr_states * nr_classes
+ * @dist distance accepted in each state (capped at max_dist + 1)
+ * @min smallest entry of the row, a lower bound of any final distance
+ */
+struct lev_automaton {
+	int nr_states;
+	int nr_classes;
+	u8 classes[26];
+	u16 *trans;
+	u8 *dist;
+	u8 *min;
+};
+
+struct lev_automaton *lev_automaton_new(const char *word, int len,
+					int max_dist);
+void lev_automaton_destroy(struct lev_automaton *dfa);
+
+static inline long lev_automaton_size(const struct lev_automaton *dfa)
+{
+	return sizeof(*dfa) + (long) dfa->nr_states
+		* (dfa->nr_classes * sizeof(u16) + 2);
+}
+
+/**
+ * same contract as EditDistance(): the exact distance if it is below
+ * curr_dist, MAX_DIST + 1 otherwise.
+ */
+static inline int lev_automaton_distance(const struct lev_automaton *dfa,
+					 const char *text, int n,
+					 int curr_dist)
+{
+	int state = LEV_START_STATE;
+	int j = 0;
+
+	for (j = 0; j < n; j++) {
+		state = dfa->trans[state * dfa->nr_classes
+				   + dfa->classes[text[j] - 'a']];
+		if (dfa->min[state] >= curr_dist)
+			return MAX_DIST + 1;
+	}
+	return dfa->dist[state] < curr_dist ? dfa->dist[state] : MAX_DIST + 1;
+}
+
+#endif /* _AUTOMATON_H_ */
@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <string.h>
 #include "misc.h"
 #include "btree.h"
+#include "arena.h"
 
 static blkptr_t mem_alloc_block(struct btree *tree)
 {
@@ -52,3 +54,30 @@ void btree_mem_destroy(struct btree *tree)
 		btree_free_node(tree, tree->sb.root);
 	free(tree);
 }
+
+static blkptr_t btree_replicate_node(struct btree_node *node,
+				     struct arena *arena)
+{
+	struct btree_node *copy = arena_alloc(arena, BTREE_NODE_SIZE, 64);
+	int i = 0;
+
+	memcpy(copy, node, BTREE_NODE_SIZE);
+	if (node->header.level > 0) {
+		for (i = 0; i < node->header.size; i++) {
+			*btree_node_ptrref(copy, i) = btree_replicate_node(
+				BLK2PTR(*btree_node_ptrref(node, i)), arena);
+		}
+	}
+	return (blkptr_t) copy;
+}
+
+struct btree *btree_mem_replicate(struct btree *tree, struct arena *arena)
+{
+	struct btree *copy = arena_alloc(arena, sizeof(struct btree), 64);
+
+	*copy = *tree;
+	if (tree->sb.root != 0)
+		copy->sb.root = btree_replicate_node(BLK2PTR(tree->sb.root),
+						     arena);
+	return copy;
+}
@@ -214,6 +214,11 @@ struct btree *btree_mem_new(u8 key_len, u8 value_len,
 			    int (*compare)(const void *, const void *));
 void          btree_mem_destroy(struct btree *tree);
 
+/* read only copy of a memory btree carved out of an arena, it goes away
+ * with the arena. a cow tree may be built over it */
+struct arena;
+struct btree *btree_mem_replicate(struct btree *tree, struct arena *arena);
+
 /* cow based btree, for cloning an old tree */
 struct btree *btree_cow_new(struct btree *orig_mem_tree, struct mempool *pool);
 void          btree_cow_destroy(struct btree *cow_tree);
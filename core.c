@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <unistd.h>
 
 #include "btree.h"
 #include "match.h"
@@ -17,20 +18,146 @@
 
 static struct plan global_plan;
 static struct worker_manager worker_mgr;
+static struct numa numa;
 static struct mempool match_pool;
 static k42lock match_pool_lock;
+/* documents between BeginDocument() and EndDocument() */
+static struct list_head open_streams;
+static int nr_open_streams;
 static long maxrss;
 
 struct plan *plan_get() { return &global_plan; }
 
 ErrorCode InitializeIndex()
 {
-	plan_init(&global_plan);
-	worker_manager_init(&worker_mgr);
-	/* this is a really big pool, wow! */
+	return InitializeIndexWithConfig(NULL);
+}
+
+/* config, then the environment, then one worker per online cpu */
+static int nr_workers_of(const IndexConfig *config)
+{
+	const char *env = getenv("MISAKA_WORKERS");
+	long nr = 0;
+
+	if (config != NULL && config->num_workers != 0)
+		nr = config->num_workers;
+	else if (env != NULL)
+		nr = strtol(env, NULL, 10);
+	if (nr <= 0)
+		nr = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr <= 0)
+		nr = NR_SHADOW;
+	if (nr > MAX_SHADOW)
+		nr = MAX_SHADOW;
+	return nr;
+}
+
+/* config, then the environment, off by default */
+static int numa_mode_of(const IndexConfig *config)
+{
+	const char *env = getenv("MISAKA_NUMA");
+
+	if (config != NULL && config->numa != 0)
+		return config->numa < 0 ? 0 : config->numa;
+	return env != NULL ? atoi(env) : 0;
+}
+
+/* config, then the environment, else DOC_BATCH_DEFAULT */
+static int batch_docs_of(const IndexConfig *config)
+{
+	const char *env = getenv("MISAKA_BATCH");
+	long nr = DOC_BATCH_DEFAULT;
+
+	if (config != NULL && config->batch_docs != 0)
+		nr = config->batch_docs;
+	else if (env != NULL)
+		nr = strtol(env, NULL, 10);
+	if (nr < 1)
+		nr = 1;
+	if (nr > DOC_BATCH_MAX)
+		nr = DOC_BATCH_MAX;
+	return nr;
+}
+
+/* config, then the environment, else a couple per worker */
+static long max_docs_of(const IndexConfig *config, int nr_workers)
+{
+	const char *env = getenv("MISAKA_MAX_DOCS");
+	long nr = 0;
+
+	if (config != NULL && config->max_inflight_docs != 0)
+		nr = config->max_inflight_docs;
+	else if (env != NULL)
+		nr = strtol(env, NULL, 10);
+	if (nr <= 0) {
+		nr = nr_workers * MATCH_POOL_PER_WORKER;
+		if (nr < MATCH_POOL_MIN)
+			nr = MATCH_POOL_MIN;
+	}
+	if (nr > DOC_RING_SIZE)
+		nr = DOC_RING_SIZE;
+	return nr;
+}
+
+/* config, then the environment, no limit by default */
+static long max_bytes_of(const IndexConfig *config)
+{
+	const char *env = getenv("MISAKA_MAX_BYTES");
+
+	if (config != NULL && config->max_inflight_bytes != 0)
+		return config->max_inflight_bytes;
+	return env != NULL && atol(env) > 0 ? atol(env) : 0;
+}
+
+ErrorCode InitializeIndexWithConfig(const IndexConfig *config)
+{
+	const char *cpu_list = getenv("MISAKA_CPUS");
+	static int cpus[NUMA_MAX_CPUS];
+	int nr_cpus = 0, nr_workers = nr_workers_of(config);
+	long nr_matches = max_docs_of(config, nr_workers);
+	int numa_mode = numa_mode_of(config), i = 0;
+	struct worker_affinity *affinity = NULL;
+	int *shadow_node = NULL;
+
+	if (config != NULL && config->cpu_list != NULL)
+		cpu_list = config->cpu_list;
+	if (cpu_list != NULL && *cpu_list != 0) {
+		nr_cpus = numa_parse_cpus(cpu_list, cpus, NUMA_MAX_CPUS);
+		if (nr_cpus < 0)
+			return EC_FAIL;
+	}
+
+	/* a core each from the list, else the cpus of a node in turn */
+	affinity = calloc(nr_workers, sizeof(struct worker_affinity));
+	shadow_node = calloc(nr_workers, sizeof(int));
+	if (numa_mode > 0)
+		numa_init(&numa);
+	for (i = 0; i < nr_workers; i++) {
+		if (nr_cpus > 0) {
+			affinity[i].cpus = &cpus[i % nr_cpus];
+			affinity[i].nr_cpus = 1;
+			if (numa_mode > 0)
+				shadow_node[i] = numa_node_of_cpu(
+					&numa, cpus[i % nr_cpus]);
+		} else if (numa_mode > 0) {
+			shadow_node[i] = i % numa.nr_nodes;
+			affinity[i].cpus = numa.nodes[shadow_node[i]].cpus;
+			affinity[i].nr_cpus = numa.nodes[shadow_node[i]].nr_cpus;
+		}
+	}
+
+	plan_init(&global_plan, nr_workers, shadow_node,
+		  numa_mode > 1 ? &numa : NULL);
+	worker_manager_init(&worker_mgr, nr_workers, affinity,
+			    batch_docs_of(config), nr_matches,
+			    max_bytes_of(config));
+	free(affinity);
+	free(shadow_node);
 	mempool_init(&match_pool, sizeof(struct document_match),
-		     sizeof(struct document_match) * 48);
+		     sizeof(struct document_match) * nr_matches);
 	mempool_set_name(&match_pool, "match-pool");
+	list_init(&open_streams);
+	nr_open_streams = 0;
 	return EC_SUCCESS;
 }
 
@@ -71,14 +198,31 @@ ErrorCode DestroyIndex()
 	/* hack for the fix....*/
 	struct match_result *result = NULL;
 	int i = 0;
-	while ((result = worker_manager_pop(&worker_mgr)) != NULL) {
+	while ((result = worker_manager_pop(&worker_mgr, nr_open_streams))
+	       != NULL) {
 		free(result->queries);
 		free(result);
 	}
+	if (global_plan.memo.nr_sets != 0) {
+		struct memo_cache *memo = &global_plan.memo;
+		printf("memo: hits %lu misses %lu evictions %lu (%.1f%%)\n",
+		       memo->hits, memo->misses, memo->evictions,
+		       100.0 * memo->hits
+		       / (memo->hits + memo->misses + 1));
+	}
+	if (global_plan.bloom_probes != 0) {
+		struct plan *plan = &global_plan;
+		printf("bloom: probes %lu negatives %lu false positives %lu "
+		       "(%.2f%%)\n", plan->bloom_probes, plan->bloom_negatives,
+		       plan->bloom_false_pos,
+		       100.0 * plan->bloom_false_pos
+		       / (plan->bloom_false_pos + plan->bloom_negatives + 1));
+	}
 	plan_destroy(&global_plan);
+	numa_destroy(&numa);
 	mempool_destroy(&match_pool);
-	printf("timer:%luus thr:%d per-thr: %luus\n", clock_cnt, NR_SHADOW,
-	       clock_cnt / NR_SHADOW);
+	printf("timer:%luus thr:%d per-thr: %luus\n", clock_cnt,
+	       worker_mgr.nr_workers, clock_cnt / worker_mgr.nr_workers);
 	printf("nr_counter:%d ", COUNTER);
 	for (i = 0; i < COUNTER; i++) {
 		printf("%lu ", counter[i]);
@@ -93,7 +237,8 @@ ErrorCode StartQuery(QueryID qid, const char *str, MatchType match_type,
 {
 	if (match_type == MT_EXACT_MATCH)
 		threshold = 0;
-	plan_add_query(&global_plan, qid, str, match_type, threshold);
+	if (!plan_add_query(&global_plan, qid, str, match_type, threshold))
+		return EC_FAIL;
 	return EC_SUCCESS;
 }
 
@@ -103,16 +248,13 @@ ErrorCode EndQuery(QueryID qid)
 	return EC_SUCCESS;
 }
 
+/* only after worker_manager_admit(), so the pool has one to spare */
 void *alloc_match_obj()
 {
 	void *match = NULL;
-again:
 	k42_lock(&match_pool_lock);
 	match = mempool_alloc(&match_pool);
 	k42_unlock(&match_pool_lock);
-	if (match == NULL) {
-		goto again;
-	}
 	return match;
 }
 
@@ -123,24 +265,157 @@ void free_match_obj(void *ptr)
 	k42_unlock(&match_pool_lock);
 }
 
-ErrorCode MatchDocument(DocID doc_id, const char *str)
+static void release_doc_copy(const char *doc_str, void *arg)
+{
+	free((void *) doc_str);
+}
+
+/* plan changes must land before a document takes its snapshot */
+static void prepare_match()
 {
-	struct document_match *match = NULL;
 	if (!list_empty(&plan_get()->dirty_ops)) {
 		plan_rebuild(plan_get());
 	}
+	/* only renumber the dictionary while no document is in flight */
+	if (WORD_DICT && worker_mgr.nr_pending == 0
+	    && plan_get()->dict.nr_words > DICT_EVICT_WORDS)
+		plan_dict_evict(plan_get());
+}
 
-	match = alloc_match_obj();
-	match_init(match, doc_id, str);
+/**
+ * room for a document of `len` bytes. open documents keep their slots
+ * until they are ended, so once they hold all of them nothing would ever
+ * make room and this fails right away
+ */
+static int admit_document(long len, int mode)
+{
+	prepare_match();
+	if (mode == ADMIT_WAIT && nr_open_streams >= worker_mgr.max_pending)
+		mode = ADMIT_TRY;
+	return worker_manager_admit(&worker_mgr, 1, len, mode);
+}
+
+static ErrorCode submit_document(DocID doc_id, const char *str,
+				 unsigned int len, DocReleaseFn release,
+				 void *release_arg)
+{
+	struct document_match *match = alloc_match_obj();
 
+	if (match == NULL) {
+		worker_manager_unadmit(&worker_mgr, 1, len);
+		return EC_FAIL;
+	}
+	match_init(match, doc_id, str, len, release, release_arg);
 	worker_manager_push(&worker_mgr, match);
 	return EC_SUCCESS;
 }
 
+static ErrorCode copy_document(DocID doc_id, const char *str, int mode)
+{
+	/* the caller may reuse str as soon as we return */
+	int len = strlen(str);
+	char *copy = NULL;
+	ErrorCode err = EC_SUCCESS;
+
+	if (!admit_document(len, mode))
+		return EC_BUSY;
+	copy = malloc(len);
+	memcpy(copy, str, len);
+	err = submit_document(doc_id, copy, len, release_doc_copy, NULL);
+	if (err != EC_SUCCESS)
+		free(copy);
+	return err;
+}
+
+ErrorCode MatchDocument(DocID doc_id, const char *str)
+{
+	return copy_document(doc_id, str, ADMIT_WAIT);
+}
+
+ErrorCode TryMatchDocument(DocID doc_id, const char *str)
+{
+	return copy_document(doc_id, str, ADMIT_TRY);
+}
+
+ErrorCode MatchDocumentBuffer(DocID doc_id, const char *str,
+			      unsigned int len, DocReleaseFn release,
+			      void *release_arg)
+{
+	if (!admit_document(len, ADMIT_WAIT))
+		return EC_BUSY;
+	return submit_document(doc_id, str, len, release, release_arg);
+}
+
+static struct match_stream *find_stream(DocID doc_id)
+{
+	struct list_head *entry = NULL;
+	for (entry = open_streams.next; entry != &open_streams;
+	     entry = entry->next) {
+		struct match_stream *stream =
+			container_of(entry, struct match_stream, head);
+		if (stream->doc_id == doc_id)
+			return stream;
+	}
+	return NULL;
+}
+
+ErrorCode BeginDocument(DocID doc_id)
+{
+	struct document_match *match = NULL;
+	if (find_stream(doc_id) != NULL)
+		return EC_FAIL;
+	/* its bytes are accounted chunk by chunk */
+	if (!admit_document(0, ADMIT_WAIT))
+		return EC_BUSY;
+
+	/* it goes on the ring with its first chunk */
+	match = alloc_match_obj();
+	if (match == NULL) {
+		worker_manager_unadmit(&worker_mgr, 1, 0);
+		return EC_FAIL;
+	}
+	match_init(match, doc_id, NULL, 0, NULL, NULL);
+	match->stream = match_stream_new(match, doc_id);
+	list_add(&match->stream->head, &open_streams);
+	nr_open_streams++;
+	return EC_SUCCESS;
+}
+
+ErrorCode AppendDocumentChunk(DocID doc_id, const char *chunk,
+			      unsigned int len)
+{
+	struct match_stream *stream = find_stream(doc_id);
+	if (stream == NULL)
+		return EC_FAIL;
+	if (len > 0) {
+		/* the bytes go as soon as a worker has tokenized them */
+		worker_manager_admit(&worker_mgr, 0, len, ADMIT_WAIT);
+		if (match_stream_append(stream, chunk, len))
+			worker_manager_push(&worker_mgr, stream->match);
+	}
+	return EC_SUCCESS;
+}
+
+ErrorCode EndDocument(DocID doc_id)
+{
+	struct match_stream *stream = find_stream(doc_id);
+	struct document_match *match = NULL;
+	if (stream == NULL)
+		return EC_FAIL;
+	/* a worker may free the stream as soon as it is ended */
+	match = stream->match;
+	list_del(&stream->head);
+	nr_open_streams--;
+	if (match_stream_end(stream))
+		worker_manager_push(&worker_mgr, match);
+	return EC_SUCCESS;
+}
+
 ErrorCode GetNextAvailRes(DocID *doc_id_ret, unsigned int *nr_ret,
 			  QueryID **q_ret)
 {
-	struct match_result *result = worker_manager_pop(&worker_mgr);
+	struct match_result *result = worker_manager_pop(&worker_mgr,
+							 nr_open_streams);
 	if (result == NULL)
 		return EC_NO_AVAIL_RES;
 	// update_mem_usage();
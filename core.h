@@ -105,7 +105,12 @@ typedef enum {
 	 * Used only for debugging purposes, and must not be returned in the
 	 * final submission.
 	 */
-	EC_FAIL
+	EC_FAIL,
+	/**
+	 * Returned by TryMatchDocument() when the index has no room for
+	 * another document in flight; retry once results have been taken.
+	 */
+	EC_BUSY
 } ErrorCode;
 
 unsigned long start_timer();
@@ -164,6 +169,8 @@ ErrorCode DestroyIndex();
  * @return ErrorCode
  *   - \ref EC_SUCCESS
  *          if the query was registered successfully
+ *   - \ref EC_FAIL
+ *          if the query pools are exhausted, the query is not active
  */
 ErrorCode StartQuery(QueryID        query_id,
                      const char*    query_str,
@@ -203,6 +210,9 @@ ErrorCode EndQuery(QueryID query_id);
  *   @return ErrorCode
  *   - \ref EC_SUCCESS
  *          if the document was added successfully
+ *   - \ref EC_BUSY
+ *          if open documents (BeginDocument()) hold every slot, see
+ *          TryMatchDocument()
  */
 ErrorCode MatchDocument(DocID         doc_id,
                         const char*   doc_str);
@@ -241,6 +251,158 @@ ErrorCode GetNextAvailRes(DocID*         p_doc_id,
                           unsigned int*  p_num_res,
                           QueryID**      p_query_ids);
 
+////////////////////////////////////////////////////////////////////////////////
+//******************************************************************************
+// Extensions
+
+/**
+ * Called by a worker once it is done with a document buffer handed over by
+ * MatchDocumentBuffer().
+ */
+typedef void (*DocReleaseFn)(const char* doc_str, void* arg);
+
+/**
+ * Push a document without copying it.
+ *
+ * @param[in] doc_str
+ *   The document, same contents as for MatchDocument() but not
+ *   necessarily null-terminated. It is only read, and must stay valid until
+ *   "release" is called with it.
+ *
+ * @param[in] doc_len
+ *   Number of characters in "doc_str".
+ *
+ * @param[in] release
+ *   Called from a worker thread once the document has been matched, may be
+ *   NULL for a buffer that outlives the index.
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the document was added successfully
+ *   - \ref EC_BUSY
+ *          as for MatchDocument(), "release" is not called then
+ */
+ErrorCode MatchDocumentBuffer(DocID         doc_id,
+                              const char*   doc_str,
+                              unsigned int  doc_len,
+                              DocReleaseFn  release,
+                              void*         release_arg);
+
+/**
+ * MatchDocument() that does not wait for room. MatchDocument() and
+ * MatchDocumentBuffer() sleep while "max_inflight_docs" documents or
+ * "max_inflight_bytes" of document buffers are in flight, see IndexConfig;
+ * this returns instead. The document is not copied unless it is taken.
+ * Open documents (BeginDocument()) keep their slot until they are ended;
+ * once they hold all of them waiting would never end, and the others fail
+ * with EC_BUSY as this does.
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the document was added successfully
+ *   - \ref EC_BUSY
+ *          if it was not, nothing is kept of it
+ */
+ErrorCode TryMatchDocument(DocID         doc_id,
+                           const char*   doc_str);
+
+/**
+ * Start a document that is handed over in chunks, see
+ * AppendDocumentChunk() and EndDocument(). Workers tokenize the chunks as
+ * they arrive, in between other documents, so an open document does not
+ * hold a worker; the result is the one MatchDocument() gives for the
+ * concatenated chunks.
+ *
+ * No query may be started or ended while a document is open.
+ * GetNextAvailRes() does not wait for open documents, it returns
+ * EC_NO_AVAIL_RES once only they are left.
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the document was started
+ *   - \ref EC_FAIL
+ *          if a document with this id is open already
+ *   - \ref EC_BUSY
+ *          if open documents hold every slot, see TryMatchDocument()
+ */
+ErrorCode BeginDocument(DocID doc_id);
+
+/**
+ * Append to an open document. Chunks may split words anywhere, they are
+ * copied and may be reused once the call returns. Chunks count against
+ * "max_inflight_bytes" until a worker has tokenized them, and wait for it
+ * like MatchDocument() does.
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the chunk was queued
+ *   - \ref EC_FAIL
+ *          if the document is not open
+ */
+ErrorCode AppendDocumentChunk(DocID         doc_id,
+                              const char*   chunk,
+                              unsigned int  len);
+
+/**
+ * Close a document, its result becomes available through GetNextAvailRes().
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the document was closed
+ *   - \ref EC_FAIL
+ *          if the document is not open
+ */
+ErrorCode EndDocument(DocID doc_id);
+
+/// Index settings, see InitializeIndexWithConfig().
+typedef struct IndexConfig
+{
+	/// Number of worker threads, 0 for the MISAKA_WORKERS environment
+	/// variable or else one per online cpu.
+	unsigned int num_workers;
+
+	/// Cores to pin the workers to, e.g. "0-3,8": worker i runs on the
+	/// i-th core of the list, wrapping around. NULL for the MISAKA_CPUS
+	/// environment variable, no pinning when neither is set.
+	const char* cpu_list;
+
+	/// NUMA placement: 1 spreads the workers over the nodes and pins
+	/// each to the cpus of its node (or, with "cpu_list", only records
+	/// the node of its core), 2 also keeps a copy of the hot parts of
+	/// the index on every node. -1 for off, 0 for the MISAKA_NUMA
+	/// environment variable, off when unset.
+	int numa;
+
+	/// Most queued documents a worker matches together, sharing the
+	/// distance work over their union vocabulary; results are reported
+	/// per document as usual. 0 for the MISAKA_BATCH environment
+	/// variable, at most 64.
+	unsigned int batch_docs;
+
+	/// Most documents submitted and not yet matched; submitting another
+	/// waits for a worker to finish one. 0 for the MISAKA_MAX_DOCS
+	/// environment variable, else twice the workers and at least 48.
+	/// At most 512.
+	unsigned int max_inflight_docs;
+
+	/// Most bytes of document buffers held for documents not yet
+	/// tokenized, MatchDocument() copies included. A larger document is
+	/// let in once nothing else is held. 0 for the MISAKA_MAX_BYTES
+	/// environment variable, no limit when unset.
+	unsigned long max_inflight_bytes;
+} IndexConfig;
+
+/**
+ * InitializeIndex() with explicit settings, "config" may be NULL.
+ *
+ * @return ErrorCode
+ *   - \ref EC_SUCCESS
+ *          if the index was initialized
+ *   - \ref EC_FAIL
+ *          if "cpu_list" cannot be parsed
+ */
+ErrorCode InitializeIndexWithConfig(const IndexConfig* config);
+
 ////////////////////////////////////////////////////////////////////////////////
 //******************************************************************************
 
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "memo.h"
+
+/* slot of the word in the index, or of the empty slot ending its probe */
+static u64 *dict_slot(struct word_dict *dict, const char *word, u64 hash)
+{
+	u64 tag = hash & ~0xffffffffULL;
+	u64 pos = hash;
+
+	for (;; pos++) {
+		u64 *slot = &dict->index[pos & (DICT_INDEX_SLOTS - 1)];
+		u32 id = (u32) *slot - 1;
+		if (*slot == 0)
+			return slot;
+		if ((*slot & ~0xffffffffULL) == tag
+		    && memcmp(dict_word(dict, id), word, sizeof(word_t)) == 0)
+			return slot;
+	}
+}
+
+void dict_init(struct word_dict *dict)
+{
+	memset(dict, 0, sizeof(struct word_dict));
+	pthread_rwlock_init(&dict->lock, NULL);
+	dict->index = calloc(DICT_INDEX_SLOTS, sizeof(u64));
+}
+
+static void dict_free_chunks(struct word_dict *dict)
+{
+	int i = 0, j = 0;
+
+	for (i = 0; i < DICT_NR_CHUNKS; i++) {
+		free(dict->words[i]);
+		free(dict->last_seen[i]);
+		dict->words[i] = NULL;
+		dict->last_seen[i] = NULL;
+		for (j = 0; j <= MAX_WORD_LENGTH; j++) {
+			free(dict->buckets[j].chunks[i]);
+			dict->buckets[j].chunks[i] = NULL;
+		}
+	}
+}
+
+void dict_destroy(struct word_dict *dict)
+{
+	dict_free_chunks(dict);
+	free(dict->index);
+	pthread_rwlock_destroy(&dict->lock);
+}
+
+/* append a word at its empty index slot, the write lock is held */
+static u32 dict_add(struct word_dict *dict, u64 *slot, const char *word,
+		    u64 hash, int len)
+{
+	struct dict_bucket *bucket = &dict->buckets[len];
+	u32 id = dict->nr_words;
+	u32 pos = bucket->num;
+	int chunk = id >> DICT_CHUNK_SHIFT;
+
+	if (id >= DICT_MAX_WORDS)
+		return DICT_NO_ID;
+	if (dict->words[chunk] == NULL) {
+		dict->words[chunk] = malloc(sizeof(word_t) * DICT_CHUNK_SIZE);
+		dict->last_seen[chunk] = malloc(sizeof(u32) * DICT_CHUNK_SIZE);
+	}
+	memcpy(dict->words[chunk][id & (DICT_CHUNK_SIZE - 1)], word,
+	       sizeof(word_t));
+	chunk = pos >> DICT_CHUNK_SHIFT;
+	if (bucket->chunks[chunk] == NULL)
+		bucket->chunks[chunk] = malloc(sizeof(u32) * DICT_CHUNK_SIZE);
+	bucket->chunks[chunk][pos & (DICT_CHUNK_SIZE - 1)] = id;
+	*slot = (hash & ~0xffffffffULL) | (id + 1);
+	/* readers go by the counters, publish the entries first */
+	__atomic_store_n(&bucket->num, pos + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&dict->nr_words, id + 1, __ATOMIC_RELEASE);
+	return id;
+}
+
+int dict_intern(struct word_dict *dict, const word_t *words,
+		const u64 *hashes, int num, int len, u32 stamp, u32 *ids)
+{
+	int nr_missing = 0, nr_ids = 0;
+	int i = 0;
+
+	pthread_rwlock_rdlock(&dict->lock);
+	for (i = 0; i < num; i++) {
+		u64 slot = 0;
+		if (i + 8 < num)
+			__builtin_prefetch(&dict->index[hashes[i + 8]
+					   & (DICT_INDEX_SLOTS - 1)]);
+		slot = *dict_slot(dict, words[i], hashes[i]);
+		ids[i] = (u32) slot - 1;
+		nr_missing += slot == 0;
+	}
+	pthread_rwlock_unlock(&dict->lock);
+
+	if (nr_missing != 0) {
+		pthread_rwlock_wrlock(&dict->lock);
+		for (i = 0; i < num; i++) {
+			u64 *slot = NULL;
+			if (ids[i] != DICT_NO_ID)
+				continue;
+			/* someone else may have added it meanwhile */
+			slot = dict_slot(dict, words[i], hashes[i]);
+			ids[i] = *slot != 0 ? (u32) *slot - 1
+				: dict_add(dict, slot, words[i], hashes[i],
+					   len);
+		}
+		pthread_rwlock_unlock(&dict->lock);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (ids[i] == DICT_NO_ID)
+			continue;
+		dict->last_seen[ids[i] >> DICT_CHUNK_SHIFT]
+			[ids[i] & (DICT_CHUNK_SIZE - 1)] = stamp;
+		nr_ids++;
+	}
+	return nr_ids;
+}
+
+static int stamp_compare(const void *p, const void *q)
+{
+	u32 a = *(const u32 *) p, b = *(const u32 *) q;
+	return a < b ? -1 : a > b;
+}
+
+void dict_evict(struct word_dict *dict, u32 *remap,
+		u32 *ranks[MAX_WORD_LENGTH + 1])
+{
+	u32 nr_words = dict->nr_words;
+	u32 *stamps = malloc(sizeof(u32) * (nr_words + 1));
+	word_t *words = malloc(sizeof(word_t) * (nr_words + 1));
+	u32 *last_seen = malloc(sizeof(u32) * (nr_words + 1));
+	u32 threshold = 0, id = 0;
+	int len = 0;
+
+	for (id = 0; id < nr_words; id++) {
+		stamps[id] = dict->last_seen[id >> DICT_CHUNK_SHIFT]
+			[id & (DICT_CHUNK_SIZE - 1)];
+		memcpy(words[id], dict_word(dict, id), sizeof(word_t));
+		last_seen[id] = stamps[id];
+	}
+	if (nr_words > DICT_KEEP_WORDS) {
+		qsort(stamps, nr_words, sizeof(u32), stamp_compare);
+		threshold = stamps[nr_words - DICT_KEEP_WORDS];
+	}
+
+	/* the buckets give the new ids: kept words in arrival order */
+	for (len = 0; len <= MAX_WORD_LENGTH; len++) {
+		struct dict_bucket *bucket = &dict->buckets[len];
+		u32 pos = 0, kept = 0;
+		ranks[len] = malloc(sizeof(u32) * (bucket->num + 1));
+		for (pos = 0; pos < bucket->num; pos++) {
+			u32 old = dict_bucket_id(bucket, pos);
+			ranks[len][pos] = kept;
+			remap[old] = last_seen[old] >= threshold ? 0 : DICT_NO_ID;
+			kept += remap[old] == 0;
+		}
+		ranks[len][pos] = kept;
+	}
+
+	memset(dict->index, 0, DICT_INDEX_SLOTS * sizeof(u64));
+	dict_free_chunks(dict);
+	dict->nr_words = 0;
+	for (len = 0; len <= MAX_WORD_LENGTH; len++)
+		dict->buckets[len].num = 0;
+	for (id = 0; id < nr_words; id++) {
+		int len = strlen(words[id]);
+		u64 hash = memo_word_hash(words[id]);
+		u32 new_id = 0;
+		if (remap[id] == DICT_NO_ID)
+			continue;
+		new_id = dict_add(dict, dict_slot(dict, words[id], hash),
+				  words[id], hash, len);
+		dict->last_seen[new_id >> DICT_CHUNK_SHIFT]
+			[new_id & (DICT_CHUNK_SIZE - 1)] = last_seen[id];
+		remap[id] = new_id;
+	}
+	free(stamps);
+	free(words);
+	free(last_seen);
+}
@@ -0,0 +1,97 @@
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <pthread.h>
+
+#include "misc.h"
+#include "core.h"
+
+/* match operators through their dictionary neighbourhoods, 0 disables */
+#define WORD_DICT 1
+
+/* most words the dictionary holds, the memory cap */
+#define DICT_MAX_WORDS (1 << 21)
+/* cold words are evicted once this many are held and the workers idle */
+#define DICT_EVICT_WORDS (DICT_MAX_WORDS / 4 * 3)
+/* eviction keeps this many of the most recently seen words */
+#define DICT_KEEP_WORDS (DICT_MAX_WORDS / 4)
+/* open addressing index, at most half full */
+#define DICT_INDEX_SLOTS (DICT_MAX_WORDS * 2)
+/* an operator scans its backlog of new words once the documents it was
+ * matched against the slow way add up to this many times the backlog: the
+ * batch kernels and the doc trie make the slow way cheaper than a scan */
+#define DICT_BACKLOG_RATIO 2
+
+#define DICT_CHUNK_SHIFT 12
+#define DICT_CHUNK_SIZE (1 << DICT_CHUNK_SHIFT)
+#define DICT_NR_CHUNKS (DICT_MAX_WORDS >> DICT_CHUNK_SHIFT)
+
+#define DICT_NO_ID ((u32) -1)
+
+/* ids of the words of one length, in arrival order */
+struct dict_bucket {
+	u32 *chunks[DICT_NR_CHUNKS];
+	volatile u32 num;
+};
+
+/**
+ * interned dictionary of every doc word seen, with dense stable ids. ids
+ * and buckets are append-only between two evictions and published by
+ * bumping the counters, so they are read without the lock; only the hash
+ * index needs it. eviction renumbers and runs while no document is being
+ * matched.
+ *
+ * @index linear probing table of (high hash bits << 32 | id + 1), 0 empty
+ * @words word of each id, zero-padded
+ * @last_seen document clock of the last document containing each id
+ * @buckets ids by word length
+ */
+struct word_dict {
+	pthread_rwlock_t lock;
+	u64 *index;
+	word_t *words[DICT_NR_CHUNKS];
+	u32 *last_seen[DICT_NR_CHUNKS];
+	volatile u32 nr_words;
+	volatile u32 clock;
+	struct dict_bucket buckets[MAX_WORD_LENGTH + 1];
+};
+
+void dict_init(struct word_dict *dict);
+void dict_destroy(struct word_dict *dict);
+
+/**
+ * look up, or add, `num` zero-padded words of length `len` with their
+ * memo_word_hash() and stamp them with `stamp`. words that do not fit under
+ * DICT_MAX_WORDS get DICT_NO_ID; returns how many did.
+ */
+int dict_intern(struct word_dict *dict, const word_t *words,
+		const u64 *hashes, int num, int len, u32 stamp, u32 *ids);
+
+/**
+ * drop all but the DICT_KEEP_WORDS most recently seen words and renumber
+ * the rest in order. `remap` receives the new id of each old id, or
+ * DICT_NO_ID, and must hold the old nr_words entries. `ranks` receives
+ * per length a malloc'd array giving, for each old bucket position, the
+ * new position, so that the caller can move its watermarks; it frees them.
+ */
+void dict_evict(struct word_dict *dict, u32 *remap,
+		u32 *ranks[MAX_WORD_LENGTH + 1]);
+
+/* one tick per document, the age of a word is the last tick it was seen */
+static inline u32 dict_tick(struct word_dict *dict)
+{
+	return __sync_add_and_fetch(&dict->clock, 1);
+}
+
+static inline const char *dict_word(struct word_dict *dict, u32 id)
+{
+	return dict->words[id >> DICT_CHUNK_SHIFT][id & (DICT_CHUNK_SIZE - 1)];
+}
+
+static inline u32 dict_bucket_id(struct dict_bucket *bucket, u32 pos)
+{
+	return bucket->chunks[pos >> DICT_CHUNK_SHIFT]
+		[pos & (DICT_CHUNK_SIZE - 1)];
+}
+
+#endif /* _DICT_H_ */
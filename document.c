@@ -12,15 +12,108 @@
 #include "core.h"
 #include "misc.h"
 
-static unsigned long doc_word_hash(const void *p)
+static inline u8 wordset_tag(u64 hash)
 {
-	const char *str = *(const char **) p;
-	char ch = 0;
-	unsigned long res = 0;
-	while ((ch = *(str++))) {
-		res = (res << 8) + (res << 4) - res + ch - 'a';
+	return 0x80 | (hash >> 57);
+}
+
+/* bit i is set when tag i of the group equals `tag` */
+static inline unsigned int wordset_match(const u8 *tags, u8 tag)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_load_si128((const __m128i *) tags);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+	unsigned int mask = 0;
+	int i = 0;
+	for (i = 0; i < WORDSET_GROUP; i++)
+		mask |= (tags[i] == tag) << i;
+	return mask;
+#endif
+}
+
+/* size the set for `nr_words` and empty it, it only ever grows */
+static void wordset_reset(struct wordset *set, int nr_words)
+{
+	u32 nr_groups = 1;
+	while (nr_groups * WORDSET_GROUP < (u32) nr_words * WORDSET_LOAD)
+		nr_groups <<= 1;
+	if (nr_groups > set->cap_groups) {
+		free(set->tags);
+		free(set->slots);
+		if (posix_memalign((void **) &set->tags, 64,
+				   nr_groups * WORDSET_GROUP) != 0)
+			abort();
+		set->slots = malloc(sizeof(u32) * nr_groups * WORDSET_GROUP);
+		set->cap_groups = nr_groups;
+	}
+	/* only the groups this document uses are cleared */
+	set->nr_groups = nr_groups;
+	memset(set->tags, 0, nr_groups * WORDSET_GROUP);
+}
+
+/**
+ * add `word` unless an equal word is in the set already. `idx` is the
+ * wordpool slot the word will live in, the caller copies it there.
+ * return 1 if the word was added.
+ */
+static int wordset_insert(struct wordset *set, const word_t *pool,
+			  const char *word, u64 hash, u32 idx)
+{
+	u32 mask = set->nr_groups - 1;
+	u32 group = hash & mask;
+	u8 tag = wordset_tag(hash);
+
+	for (;; group = (group + 1) & mask) {
+		u8 *tags = set->tags + group * WORDSET_GROUP;
+		u32 *slots = set->slots + group * WORDSET_GROUP;
+		unsigned int hits = wordset_match(tags, tag);
+		unsigned int empty = 0;
+		for (; hits != 0; hits &= hits - 1) {
+			int i = __builtin_ctz(hits);
+			if (memcmp(pool[slots[i]], word, sizeof(word_t)) == 0)
+				return 0;
+		}
+		empty = wordset_match(tags, 0);
+		if (empty != 0) {
+			int i = __builtin_ctz(empty);
+			tags[i] = tag;
+			slots[i] = idx;
+			return 1;
+		}
+	}
+}
+
+/* `word` is zero-padded to sizeof(word_t), `hash` is its memo_word_hash() */
+int wordset_contains(struct docent *ent, const char *word, u64 hash)
+{
+	struct wordset *set = ent->set;
+	u32 mask = set->nr_groups - 1;
+	u32 group = hash & mask;
+	u8 tag = wordset_tag(hash);
+
+	/* groups are filled in probe order and never emptied, so a group
+	 * with a free slot ends the probe */
+	for (;; group = (group + 1) & mask) {
+		const u8 *tags = set->tags + group * WORDSET_GROUP;
+		const u32 *slots = set->slots + group * WORDSET_GROUP;
+		unsigned int hits = wordset_match(tags, tag);
+		for (; hits != 0; hits &= hits - 1) {
+			int i = __builtin_ctz(hits);
+			if (memcmp(ent->wordpool[slots[i]], word,
+				   sizeof(word_t)) == 0)
+				return 1;
+		}
+		if (wordset_match(tags, 0) != 0)
+			return 0;
 	}
-	return res;
+}
+
+void wordset_destroy(struct wordset *set)
+{
+	free(set->tags);
+	free(set->slots);
+	memset(set, 0, sizeof(struct wordset));
 }
 
 static int compare(const void* a, const void* b)
@@ -28,202 +121,670 @@ static int compare(const void* a, const void* b)
 	return strcmp(*(char**)a, *(char**)b);
 }
 
-struct docent *docent_new(char *doc_str)
+static struct doctrie *doctrie_new(struct docent *docent, int nr_words)
 {
-	int i = 0;
-	u8 dummy = 0;
-	struct docent* docent = malloc(sizeof(struct docent));
-	memset(docent, 0, sizeof(struct docent));
+	struct arena *arena = docent->arena;
+	struct doctrie *trie = arena_alloc(arena, sizeof(struct doctrie), 8);
+	const char **words = NULL;
+	int i = 0, j = 0;
 
-	docent->strents = malloc(sizeof(struct strent) * WORD_LENGTH_RANGE);
-	memset(docent->strents, 0, sizeof(struct strent) * WORD_LENGTH_RANGE);
+	trie->num = nr_words;
+	trie->words = arena_alloc(arena, sizeof(char *) * nr_words, 8);
+	words = trie->words;
+	trie->lens = arena_alloc(arena, nr_words, 1);
+	trie->lcp = arena_alloc(arena, nr_words, 1);
+	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
+		for (j = 0; j < docent->strents[i].num; j++)
+			*words++ = docent->strents[i].words[j];
+	}
+	qsort(trie->words, nr_words, sizeof(char *), compare);
+	for (i = 0; i < nr_words; i++) {
+		const char *prev = i > 0 ? trie->words[i - 1] : "";
+		const char *word = trie->words[i];
+		for (j = 0; prev[j] != 0 && prev[j] == word[j]; j++)
+			;
+		trie->lcp[i] = j;
+		trie->lens[i] = j + strlen(word + j);
+	}
+	return trie;
+}
 
-	docent->doc_str = doc_str;
+/* block and bits of a word, from its memo_word_hash() */
+static inline u64 doc_bloom_hash(u64 hash)
+{
+	return hash * 0xc2b2ae3d27d4eb4fULL;
+}
 
-	int done = 0;
-	char *ptr = doc_str;
-	while (*ptr) {
-		while(*ptr == ' ') ptr++;
-		if(!ptr) break;
+static inline u64 *doc_bloom_block(struct docent *docent, u64 h)
+{
+	return docent->bloom
+		+ ((h >> 40) & docent->bloom_mask) * (DOC_BLOOM_BLOCK_BITS / 64);
+}
 
-		char *start = ptr;
-		while(*ptr && *ptr != ' ') ptr++;
+static void doc_bloom_build(struct docent *docent)
+{
+	u32 nr_blocks = 1;
+	int i = 0, j = 0;
 
-		// char dt = docent->doc_str[id];
-		// docent->doc_str[id] = '\0';
+	while (nr_blocks * DOC_BLOOM_BLOCK_BITS
+	       < (u32) docent->nr_words * DOC_BLOOM_BITS_PER_WORD)
+		nr_blocks <<= 1;
+	docent->bloom = arena_alloc(docent->arena,
+				    nr_blocks * DOC_BLOOM_BLOCK_BITS / 8, 64);
+	docent->bloom_mask = nr_blocks - 1;
+	memset(docent->bloom, 0, nr_blocks * DOC_BLOOM_BLOCK_BITS / 8);
+	for (i = 0; i < docent->nr_words; i++) {
+		u64 h = doc_bloom_hash(docent->hashpool[i]);
+		u64 *block = doc_bloom_block(docent, h);
+		for (j = 0; j < DOC_BLOOM_HASHES; j++) {
+			int bit = (h >> (9 * j)) & (DOC_BLOOM_BLOCK_BITS - 1);
+			block[bit >> 6] |= 1ULL << (bit & 63);
+		}
+	}
+}
 
-		int ld = ptr - start;
-		docent->strents[ld-MIN_WORD_LENGTH].num++;
+/* 0 if the word is certainly not in the document, one cache line touched */
+static inline int doc_bloom_test(struct docent *docent, u64 hash)
+{
+	u64 h = doc_bloom_hash(hash);
+	const u64 *block = doc_bloom_block(docent, h);
+	int j = 0;
 
-		// docent->doc_str[id]=dt;
-		if (((ptr - doc_str) & ((1 << 9) - 1)) == 0) PREFETCH(ptr);
+	for (j = 0; j < DOC_BLOOM_HASHES; j++) {
+		int bit = (h >> (9 * j)) & (DOC_BLOOM_BLOCK_BITS - 1);
+		if (!(block[bit >> 6] & (1ULL << (bit & 63))))
+			return 0;
 	}
+	return 1;
+}
 
-	int total_word_num = 0;
-	unsigned int word_cnt[WORD_LENGTH_RANGE];
-	memset(word_cnt, 0, sizeof(word_cnt));
+/**
+ * make room for `nr_words` unique words: the staging arrays and the word
+ * set grow together. the words already in the set are put back, their
+ * indexes into the staging arrays do not change.
+ */
+static void doc_stream_reserve(struct doc_stream *stream, int nr_words)
+{
+	struct wordset *set = stream->docent->set;
+	struct arena *arena = stream->docent->arena;
+	int i = 0;
 
-	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
-		total_word_num += docent->strents[i].num;
+	if (nr_words > stream->cap) {
+		int cap = stream->cap * 2 > nr_words ? stream->cap * 2 : nr_words;
+		word_t *words = arena_alloc(arena, sizeof(word_t) * cap, 64);
+		u64 *hashes = arena_alloc(arena, sizeof(u64) * cap, 8);
+		u8 *lens = arena_alloc(arena, cap, 1);
+
+		/* the old arrays stay in the arena until the document is done */
+		memcpy(words, stream->words, sizeof(word_t) * stream->nr_words);
+		memcpy(hashes, stream->hashes, sizeof(u64) * stream->nr_words);
+		memcpy(lens, stream->lens, stream->nr_words);
+		stream->words = words;
+		stream->hashes = hashes;
+		stream->lens = lens;
+		stream->cap = cap;
+	}
+	if ((u32) nr_words * WORDSET_LOAD > set->nr_groups * WORDSET_GROUP) {
+		wordset_reset(set, nr_words);
+		for (i = 0; i < stream->nr_words; i++)
+			wordset_insert(set, stream->words, stream->words[i],
+				       stream->hashes[i], i);
 	}
+}
 
-	docent->strpool = malloc(sizeof(char*) * total_word_num);
+/* the caller has reserved room for one more word */
+static void doc_stream_add(struct doc_stream *stream, const char *word,
+			   int len)
+{
+	word_t *slot = &stream->words[stream->nr_words];
+	u64 hash = 0;
 
-	char* *strptr = docent->strpool;
-	docent->strents[0].ptr = strptr;
-	for (i = 1; i < WORD_LENGTH_RANGE; i++) {
-		strptr += docent->strents[i-1].num;
-		docent->strents[i].ptr = strptr;
+	/* staged in place, it only counts once the set takes it */
+	memset(*slot, 0, sizeof(word_t));
+	memcpy(*slot, word, len);
+	hash = memo_word_hash(*slot);
+	if (!wordset_insert(stream->docent->set, stream->words, *slot, hash,
+			    stream->nr_words))
+		return;
+	stream->hashes[stream->nr_words] = hash;
+	stream->lens[stream->nr_words++] = len;
+}
+
+void docent_stream_begin(struct doc_stream *stream, struct wordset *set,
+			 struct arena *arena)
+{
+	struct docent* docent = arena_alloc(arena, sizeof(struct docent), 8);
+	memset(docent, 0, sizeof(struct docent));
+	docent->arena = arena;
+	docent->set = set;
+
+	memset(stream, 0, sizeof(struct doc_stream));
+	stream->docent = docent;
+	stream->cap = DOC_STREAM_MIN_WORDS;
+	stream->words = arena_alloc(arena, sizeof(word_t) * stream->cap, 64);
+	stream->hashes = arena_alloc(arena, sizeof(u64) * stream->cap, 8);
+	stream->lens = arena_alloc(arena, stream->cap, 1);
+	wordset_reset(set, stream->cap);
+}
+
+/**
+ * tokenize `chunk` and dedup its words into the stream. a word cut by the
+ * end of the chunk is carried over and glued to the head of the next one.
+ */
+void docent_stream_feed(struct doc_stream *stream, const char *chunk,
+			int len)
+{
+	struct arena *arena = stream->docent->arena;
+	int start = 0;
+	int i = 0;
+
+	if (stream->carry_len > 0) {
+		while (start < len && chunk[start] != ' ')
+			start++;
+		assert(stream->carry_len + start <= MAX_WORD_LENGTH);
+		memcpy(stream->carry + stream->carry_len, chunk, start);
+		stream->carry_len += start;
+		if (start == len)
+			return;
+		doc_stream_reserve(stream, stream->nr_words + 1);
+		doc_stream_add(stream, stream->carry, stream->carry_len);
+		stream->carry_len = 0;
 	}
+	chunk += start;
+	len -= start;
 
-	ptr = docent->doc_str;
-	done = 0;
-	while (!done && *ptr) {
-		while(*ptr == ' ') ptr++;
-		if(!*ptr) break;
+	/* one vectorized pass for the (offset, length) of every word */
+	u32 *offsets = arena_alloc(arena, sizeof(u32) * (len / 2 + 1), 4);
+	u8 *lens = arena_alloc(arena, len / 2 + 1, 1);
+	int nr_tokens = Tokenize(chunk, len, offsets, lens);
 
-		char* start = ptr;
-		while(*ptr && *ptr != ' ') ptr++;
-		if (!*ptr) {
-			done = 1;
-		} else {
-			*ptr = '\0';
-		}
+	if (nr_tokens > 0
+	    && offsets[nr_tokens - 1] + lens[nr_tokens - 1] == (u32) len) {
+		nr_tokens--;
+		memcpy(stream->carry, chunk + offsets[nr_tokens],
+		       lens[nr_tokens]);
+		stream->carry_len = lens[nr_tokens];
+	}
+	/* as if every token were a new word */
+	doc_stream_reserve(stream, stream->nr_words + nr_tokens);
+	for (i = 0; i < nr_tokens; i++)
+		doc_stream_add(stream, chunk + offsets[i], lens[i]);
+}
+
+/**
+ * lay the unique words out by length (a counting sort of the staging
+ * arrays), point the word set at the new slots and fill in the per word
+ * data the kernels need.
+ */
+struct docent *docent_stream_end(struct doc_stream *stream)
+{
+	struct docent *docent = stream->docent;
+	struct arena *arena = docent->arena;
+	struct wordset *set = docent->set;
+	int total_word_num = 0;
+	int i = 0, j = 0;
+
+	if (stream->carry_len > 0) {
+		doc_stream_reserve(stream, stream->nr_words + 1);
+		doc_stream_add(stream, stream->carry, stream->carry_len);
+		stream->carry_len = 0;
+	}
+	total_word_num = stream->nr_words;
+
+	docent->strents = arena_alloc(arena,
+				      sizeof(struct strent) * WORD_LENGTH_RANGE,
+				      8);
+	memset(docent->strents, 0, sizeof(struct strent) * WORD_LENGTH_RANGE);
+	for (i = 0; i < total_word_num; i++)
+		docent->strents[stream->lens[i] - MIN_WORD_LENGTH].num++;
 
-		int ld = ptr - start;
-		int bucket = ld - MIN_WORD_LENGTH;
-		int cnt = word_cnt[bucket];
+	docent->wordpool = arena_alloc(arena, sizeof(word_t)
+				       * (total_word_num + 1), 64);
+	docent->strpool = arena_alloc(arena, sizeof(char*)
+				      * (total_word_num + 1), 8);
+	docent->hashpool = arena_alloc(arena, sizeof(u64)
+				       * (total_word_num + 1), 8);
 
-		docent->strents[bucket].ptr[cnt] = start;
-		word_cnt[bucket]++;
+	unsigned int word_pos[WORD_LENGTH_RANGE];
+	for (i = 0, j = 0; i < WORD_LENGTH_RANGE; i++) {
+		struct strent *ent = &docent->strents[i];
+		ent->words = docent->wordpool + j;
+		ent->ptr = docent->strpool + j;
+		ent->hashes = docent->hashpool + j;
+		word_pos[i] = j;
+		j += ent->num;
+	}
 
-		ptr++;
+	u32 *remap = arena_alloc(arena, sizeof(u32) * (total_word_num + 1), 4);
+	for (i = 0; i < total_word_num; i++) {
+		u32 pos = word_pos[stream->lens[i] - MIN_WORD_LENGTH]++;
+		memcpy(docent->wordpool[pos], stream->words[i],
+		       sizeof(word_t));
+		docent->hashpool[pos] = stream->hashes[i];
+		docent->strpool[pos] = docent->wordpool[pos];
+		remap[i] = pos;
+	}
+	for (i = 0; i < (int) (set->nr_groups * WORDSET_GROUP); i++) {
+		if (set->tags[i] != 0)
+			set->slots[i] = remap[set->slots[i]];
 	}
+	docent->nr_words = total_word_num;
+	doc_bloom_build(docent);
 
+	docent->sigpool = arena_alloc(arena, sizeof(struct charsig)
+				      * (total_word_num + 1), 32);
+	struct charsig *sigptr = docent->sigpool;
 	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
-		int j = 0, cnt = 0;
 		struct strent *ent = &docent->strents[i];
-		ent->htbl = hashtable_new(sizeof(char *), 1,
-					  DOC_HASHTABLE_CAP,
-					  doc_word_hash, compare);
-		for (j = 0; j < ent->num; j++) {
-			int unique =
-				hashtable_insert(ent->htbl, &ent->ptr[j],
-						 &dummy);
-			if (unique) {
-				ent->ptr[cnt] = ent->ptr[j];
-				cnt++;
-			}
+		ent->sigs = sigptr;
+		for (j = 0; j < ent->num; j++)
+			CharSigInit(&ent->sigs[j], ent->ptr[j],
+				    i + MIN_WORD_LENGTH);
+		sigptr += ent->num;
+	}
+	if (WORD_DICT) {
+		struct word_dict *dict = &plan_get()->dict;
+		u32 stamp = dict_tick(dict);
+		int nr_ids = 0;
+		docent->idpool = arena_alloc(arena, sizeof(u32)
+					     * (total_word_num + 1), 4);
+		for (i = 0, j = 0; i < WORD_LENGTH_RANGE; i++) {
+			struct strent *ent = &docent->strents[i];
+			ent->ids = docent->idpool + j;
+			nr_ids += dict_intern(dict, ent->words, ent->hashes,
+					      ent->num, i + MIN_WORD_LENGTH,
+					      stamp, ent->ids);
+			j += ent->num;
 		}
-		ent->num = cnt;
+		docent->dict_complete = nr_ids == total_word_num;
 	}
+	if (total_word_num >= DOC_TRIE_MIN_WORDS)
+		docent->trie = doctrie_new(docent, total_word_num);
 	return docent;
 }
 
+struct docent *docent_new(const char *doc_str, int doc_len,
+			  struct wordset *set, struct arena *arena)
+{
+	struct doc_stream stream;
+
+	docent_stream_begin(&stream, set, arena);
+	stream.docent->doc_str = doc_str;
+	docent_stream_feed(&stream, doc_str, doc_len);
+	return docent_stream_end(&stream);
+}
+
+/* everything but the word set lives in the arena, drop it all at once */
 void docent_destroy(struct docent *ent)
 {
-	int i = 0;
-	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
-		hashtable_destroy(ent->strents[i].htbl);
-	}
-	free(ent->strents);
-	free(ent->strpool);
-	free(ent);
+	arena_reset(ent->arena);
 }
 
-static int min_edit_strent(struct docent *ent,
-			   int len, const char *word, int wlen,
+/* how far ahead the memo sets are prefetched */
+#define MEMO_PREFETCH_DIST 4
+
+static int min_edit_strent(struct docent *ent, int len, struct operator *op,
 			   int lower_bound, int *upper_bound)
 {
 	struct strent *strent = &ent->strents[len - MIN_WORD_LENGTH];
+	struct memo_cache *memo = &plan_get()->memo;
 	int i = 0;
 	long cnt = 0;
-	PREFETCH(strent->ptr);
+	long hits = 0, evictions = 0, filtered = 0;
+	int found = -1;
+	PREFETCH(strent->words);
     unsigned long s = start_timer();
 	for (i = 0; i < strent->num; i++) {
-		int dist = 0;
-		if (wlen < len) {
-			dist = EditDistance(word, wlen, strent->ptr[i], len,
-					    *upper_bound);
+		int dist = -1;
+		int curr_dist = *upper_bound;
+		u64 key = 0, check = 0;
+		/* far apart letter counts cannot beat the upper bound */
+		if (CharSigBound(&op->sig, op->len, &strent->sigs[i], len)
+		    >= curr_dist) {
+			filtered++;
+			continue;
+		}
+		if (memo->nr_sets != 0) {
+			if (i + MEMO_PREFETCH_DIST < strent->num)
+				memo_prefetch(memo, memo_key(op->hash,
+					strent->hashes[i + MEMO_PREFETCH_DIST]));
+			key = memo_key(op->hash, strent->hashes[i]);
+			check = memo_check(op->word, op->len,
+					   strent->words[i], len);
+			dist = memo_lookup(memo, key, check, curr_dist);
+		}
+		if (dist >= 0) {
+			hits++;
 		} else {
-			dist = EditDistance(strent->ptr[i], len, word, wlen,
-					    *upper_bound);
+			dist = EditDistanceBitParallel(&op->pattern,
+						       strent->words[i], len,
+						       curr_dist);
+			cnt++;
+			/* an abandoned kernel only tells dist >= curr_dist */
+			if (memo->nr_sets != 0)
+				evictions += dist < curr_dist
+					? memo_store(memo, key, check, dist, 0)
+					: memo_store(memo, key, check,
+						     curr_dist, 1);
 		}
-		cnt++;
-	done:
 		if (dist <= lower_bound) {
-            end_timer(s);
-			inc_cnt(0, cnt);
-			return dist;
+			found = dist;
+			break;
 		}
 		*upper_bound = dist < *upper_bound ? dist : *upper_bound;
 	}
     end_timer(s);
 	inc_cnt(0, cnt);
-	return *upper_bound;
+	inc_cnt(2, filtered);
+	if (memo->nr_sets != 0) {
+		__sync_fetch_and_add(&memo->hits, hits);
+		__sync_fetch_and_add(&memo->misses, cnt);
+		__sync_fetch_and_add(&memo->evictions, evictions);
+	}
+	return found >= 0 ? found : *upper_bound;
+}
+
+/**
+ * one depth first pass over the document trie for every length within the
+ * current upper bound. the DP row of depth d only depends on the first d
+ * letters, so rows are kept per depth and reused as long as the prefix is
+ * shared. once the smallest entry of a row reaches the upper bound no word
+ * below that prefix can improve it, and the whole subtree is skipped.
+ *
+ * with an automaton the state of each depth stands in for the row.
+ */
+static int min_edit_trie(struct doctrie *trie, struct operator *op,
+			 int lower_bound, int upper_bound)
+{
+	u8 rows[MAX_WORD_LENGTH + 1][MAX_WORD_LENGTH + 1];
+	u8 row_min[MAX_WORD_LENGTH + 1];
+	u16 states[MAX_WORD_LENGTH + 1];
+	struct lev_automaton *dfa = operator_dfa(plan_get(), op);
+	int m = op->len;
+	int ret = upper_bound;
+	int valid = 0;
+	int i = 0, k = 0, d = 0;
+
+	for (i = 0; i <= m; i++)
+		rows[0][i] = i;
+	row_min[0] = 0;
+	states[0] = LEV_START_STATE;
+	for (k = 0; k < trie->num; k++) {
+		const char *word = trie->words[k];
+		int n = trie->lens[k];
+		int dist = 0;
+
+		if (valid > trie->lcp[k])
+			valid = trie->lcp[k];
+		if (n - m >= ret || m - n >= ret)
+			continue;
+		for (d = valid + 1; d <= n; d++) {
+			char ch = word[d - 1];
+			if (dfa != NULL) {
+				states[d] = dfa->trans[states[d - 1]
+						       * dfa->nr_classes
+						       + dfa->classes[ch - 'a']];
+				row_min[d] = dfa->min[states[d]];
+			} else {
+				u8 *prev = rows[d - 1], *row = rows[d];
+				row[0] = d;
+				row_min[d] = d;
+				for (i = 1; i <= m; i++) {
+					int v = prev[i] + 1;
+					if (row[i - 1] + 1 < v)
+						v = row[i - 1] + 1;
+					if (prev[i - 1] + (op->word[i - 1] != ch)
+					    < v)
+						v = prev[i - 1]
+							+ (op->word[i - 1] != ch);
+					row[i] = v;
+					if (v < row_min[d])
+						row_min[d] = v;
+				}
+			}
+			valid = d;
+			if (row_min[d] >= ret)
+				break;
+		}
+		if (d <= n) {
+			/* prune every word below word[0..d) */
+			while (k + 1 < trie->num && trie->lcp[k + 1] >= d)
+				k++;
+			continue;
+		}
+		dist = dfa != NULL ? dfa->dist[states[n]] : rows[n][m];
+		if (dist < ret) {
+			ret = dist;
+			if (ret <= lower_bound)
+				return ret;
+		}
+	}
+	return ret;
+}
+
+/**
+ * evaluate the whole batch of `op` at once and remember the result of every
+ * lane, the other operators of the batch will find theirs in op_dist.
+ */
+static int batch_min_dist(struct document_match *match, MatchType match_type,
+			  struct operator *op)
+{
+	struct op_batch *batch = match->batches[op->batch->id];
+	int level = match_type - MT_HAMMING_DIST;
+	u8 min_dist[BATCH_LANES];
+	int base = batch->id * BATCH_LANES;
+	int i = 0;
+
+	memset(min_dist, MAX_DIST + 1, sizeof(min_dist));
+	if (match_type == MT_HAMMING_DIST) {
+		struct strent *strent =
+			&match->docent->strents[op->len - MIN_WORD_LENGTH];
+		HammingDistanceBatch(&batch->wb, strent->words, strent->num,
+				     min_dist);
+	} else {
+		int len = 0;
+		for (len = op->len - MAX_DIST; len <= op->len + MAX_DIST;
+		     len++) {
+			struct strent *strent = NULL;
+			if (len < MIN_WORD_LENGTH || len > MAX_WORD_LENGTH)
+				continue;
+			strent = &match->docent->strents[len - MIN_WORD_LENGTH];
+			EditDistanceBatch(&batch->wb, strent->words,
+					  strent->num, len, min_dist);
+		}
+	}
+	for (i = 0; i < BATCH_LANES; i++) {
+		if (batch->ops[i] == NULL)
+			continue;
+		if (min_dist[i] > MAX_DIST)
+			min_dist[i] = MAX_DIST + 1;
+		match->op_dist[base + i][level] = min_dist[i];
+	}
+	return match->op_dist[op->slot][level];
+}
+
+/* scan the backlog of dictionary words into the neighbourhood, held busy */
+static void neigh_extend(struct word_dict *dict, struct operator *op)
+{
+	struct op_neigh *neigh = op->neigh;
+	int i = 0;
+
+	for (i = 0; i <= 2 * MAX_DIST; i++) {
+		int len = op->len - MAX_DIST + i;
+		struct dict_bucket *bucket = NULL;
+		u32 num = 0, pos = 0;
+		if (len < MIN_WORD_LENGTH || len > MAX_WORD_LENGTH)
+			continue;
+		bucket = &dict->buckets[len];
+		num = __atomic_load_n(&bucket->num, __ATOMIC_ACQUIRE);
+		for (pos = neigh->watermarks[i]; pos < num; pos++) {
+			u32 id = dict_bucket_id(bucket, pos);
+			const char *word = dict_word(dict, id);
+			struct neigh_entry *ent = NULL;
+			int edit = 0, hamming = MAX_DIST + 1;
+			edit = EditDistanceBitParallel(&op->pattern, word,
+						       len, MAX_DIST + 1);
+			/* hamming >= edit, nothing to keep */
+			if (edit > MAX_DIST)
+				continue;
+			if (len == op->len)
+				hamming = HammingDistance(op->word, len, word,
+							  len, 0);
+			if (neigh->num == neigh->cap) {
+				neigh->cap = neigh->cap ? neigh->cap * 2 : 16;
+				neigh->ents = realloc(neigh->ents,
+						      sizeof(struct neigh_entry)
+						      * neigh->cap);
+			}
+			ent = &neigh->ents[neigh->num++];
+			ent->id = id;
+			ent->dist[0] = hamming > MAX_DIST ? MAX_DIST + 1
+							  : hamming;
+			ent->dist[1] = edit;
+		}
+		neigh->watermarks[i] = num;
+	}
+}
+
+/**
+ * both distances of the operator from its neighbourhood and the document's
+ * dictionary ids, stored in op_dist. while the backlog of unscanned
+ * dictionary words costs more than the documents matched so far, this
+ * gives up (OP_DIST_UNKNOWN) and the kernels run instead.
+ */
+static int dict_min_dist(struct document_match *match, MatchType match_type,
+			 struct operator *op)
+{
+	struct plan *plan = plan_get();
+	struct docent *docent = match->docent;
+	struct op_neigh *neigh = op->neigh;
+	u8 *members = plan->dict_members[match->shadow_id];
+	u8 dist[2] = { MAX_DIST + 1, MAX_DIST + 1 };
+	long backlog = 0, scan = 0;
+	int i = 0;
+
+	if (neigh == NULL || !docent->dict_complete
+	    || __sync_lock_test_and_set(&neigh->busy, 1))
+		return OP_DIST_UNKNOWN;
+	for (i = 0; i <= 2 * MAX_DIST; i++) {
+		int len = op->len - MAX_DIST + i;
+		if (len < MIN_WORD_LENGTH || len > MAX_WORD_LENGTH)
+			continue;
+		backlog += plan->dict.buckets[len].num - neigh->watermarks[i];
+		scan += docent->strents[len - MIN_WORD_LENGTH].num;
+	}
+	if (backlog * DICT_BACKLOG_RATIO > neigh->credit + scan) {
+		neigh->credit += scan;
+		__sync_lock_release(&neigh->busy);
+		return OP_DIST_UNKNOWN;
+	}
+	if (backlog > 0) {
+		neigh_extend(&plan->dict, op);
+		neigh->credit = 0;
+	}
+	for (i = 0; i < neigh->num; i++) {
+		struct neigh_entry *ent = &neigh->ents[i];
+		if (!bitmap_is_bit_set(members, ent->id))
+			continue;
+		if (ent->dist[0] < dist[0])
+			dist[0] = ent->dist[0];
+		if (ent->dist[1] < dist[1])
+			dist[1] = ent->dist[1];
+	}
+	__sync_lock_release(&neigh->busy);
+	match->op_dist[op->slot][0] = dist[0];
+	match->op_dist[op->slot][1] = dist[1];
+	return dist[match_type - MT_HAMMING_DIST];
 }
 
 int match_min_dist(struct document_match *doc_match, MatchType match_type,
-		   const char* word, int len,
-		   int lower_bound, int upper_bound)
+		   struct operator *op, int lower_bound, int upper_bound)
 {
+	const char *word = op->word;
+	int len = op->len;
 	int ret = upper_bound;
 
+	if (match_type != MT_EXACT_MATCH) {
+		/* already known from a batch or from the reverse matching */
+		ret = doc_match->op_dist[op->slot][match_type - MT_HAMMING_DIST];
+		if (OP_DIST_IS_BOUND(ret)) {
+			/* the deletion index only bounds it from below */
+			ret &= ~0x80;
+			if (ret >= upper_bound)
+				return upper_bound;
+			if (ret > lower_bound)
+				lower_bound = ret;
+			ret = OP_DIST_UNKNOWN;
+		}
+		if (ret == OP_DIST_UNKNOWN && WORD_DICT)
+			ret = dict_min_dist(doc_match, match_type, op);
+		if (ret == OP_DIST_UNKNOWN && op->batch != NULL
+		    && op->batch->nr_ops >= OP_BATCH_MIN_OPS
+		    && !(match_type == MT_EDIT_DIST
+			 && doc_match->docent->trie))
+			ret = batch_min_dist(doc_match, match_type, op);
+		if (ret != OP_DIST_UNKNOWN) {
+			if (match_type == MT_HAMMING_DIST && ret <= lower_bound)
+				return lower_bound;
+			return ret < upper_bound ? ret : upper_bound;
+		}
+		ret = upper_bound;
+	}
+
 	switch (match_type) {
 	case MT_EXACT_MATCH: {
-		struct strent* ent
-			= &doc_match->docent->strents[len - MIN_WORD_LENGTH];
-		if (hashtable_search(ent->htbl, &word))
-			return 0;
-		else
+		doc_match->bloom_probes++;
+		if (!doc_bloom_test(doc_match->docent, op->hash)) {
+			doc_match->bloom_negatives++;
 			return MAX_DIST + 1;
+		}
+		if (wordset_contains(doc_match->docent, word, op->hash))
+			return 0;
+		doc_match->bloom_false_pos++;
+		return MAX_DIST + 1;
 		break;
 	}
 	case MT_HAMMING_DIST: {
-		int i;
 		struct strent* strent
 			= &doc_match->docent->strents[len - MIN_WORD_LENGTH];
-		char** pstr = strent->ptr;
-		int cnt = 0;
-		/* prefetch pstr into cache line */
-		PREFETCH(pstr);
-		for (i = 0; i < strent->num; ++i) {
-			int dist = HammingDistance(pstr[i], len, word, len, ret);
-			cnt++;
-			if (dist <= lower_bound) {
-				inc_cnt(1, cnt);
-				return lower_bound;
-			}
-			ret = dist < ret ? dist: ret;
-		}
-		inc_cnt(1, cnt);
+		/* prefetch the packed words into cache line */
+		PREFETCH(strent->words);
+		ret = HammingDistanceBlock(strent->words, strent->num, word,
+					   lower_bound, ret);
+		inc_cnt(1, strent->num);
+		if (ret <= lower_bound)
+			return lower_bound;
 		break;
 	}
 	case MT_EDIT_DIST: {
 		struct docent *docent = doc_match->docent;
 		int dist = 0;
 		int i = 0;
+		if (docent->trie != NULL) {
+			ret = min_edit_trie(docent->trie, op, lower_bound, ret);
+			break;
+		}
 		for (i = 1; i < ret; ++i) {
 			int lb = i;
 			if (lower_bound > lb) lb = lower_bound;
 			if (len - i >= MIN_WORD_LENGTH) {
-				dist = min_edit_strent(docent, len - i,
-						       word, len, lb, &ret);
+				dist = min_edit_strent(docent, len - i, op,
+						       lb, &ret);
 				if (dist <= lb) {
 					return dist;
 				}
 			}
 			if (i == 2) {
 				/* if we assume hamming prefetching... */
-				dist = min_edit_strent(docent, len, word,
-						       len, lb, &ret);
+				dist = min_edit_strent(docent, len, op, lb,
+						       &ret);
 				if (dist <= lb) {
 					return dist;
 				}
 			}
 			if (len + i <= MAX_WORD_LENGTH) {
-				dist = min_edit_strent(docent, len + i,
-						       word, len, lb, &ret);
+				dist = min_edit_strent(docent, len + i, op,
+						       lb, &ret);
 				if (dist <= lb) {
 					return dist;
 				}
@@ -3,20 +3,65 @@
 
 #include "core.h"
 #include "misc.h"
-#include "hashtable.h"
+#include "util.h"
+#include "arena.h"
 
 #define WORD_LENGTH_RANGE (MAX_WORD_LENGTH - MIN_WORD_LENGTH + 1)
-#define DOC_HASHTABLE_CAP ((1 << 12) - 1)
+
+/* slots per word set group, one SSE2 compare matches a whole group */
+#define WORDSET_GROUP 16
+/* at most 1 / WORDSET_LOAD of the word set slots are used */
+#define WORDSET_LOAD 2
+
+/* documents with at least this many unique words get a prefix trie */
+#define DOC_TRIE_MIN_WORDS 2048
+/* blocked bloom filter over the words of a document: cache line sized
+ * blocks, DOC_BLOOM_HASHES bits set per word inside one block */
+#define DOC_BLOOM_BITS_PER_WORD 16
+#define DOC_BLOOM_HASHES 4
+#define DOC_BLOOM_BLOCK_BITS 512
+/* initial room for unique words, it grows with the chunks */
+#define DOC_STREAM_MIN_WORDS 1024
 
 /**
  * string entry type
- * @ptr pointer to the first string in the strpool
+ * @ptr pointer to each word in `words`, NUL terminated
+ * @words packed copies of the unique words, zero-padded to sizeof(word_t)
  * @num number of strings with the same length
  */
 struct strent {
 	char** ptr; /* indirect pointers of each word */
+	word_t *words; /* contiguous block, 32 bytes aligned */
+	u64 *hashes; /* memo_word_hash() of each word */
+	struct charsig *sigs; /* letter counts of each word */
+	u32 *ids; /* dictionary id of each word, WORD_DICT only */
 	unsigned int num;
-	struct hashtable *htbl; /* hashtable of all words */
+};
+
+/**
+ * flat set of the unique words of a document, keyed by memo_word_hash(). the
+ * slots come in groups of WORDSET_GROUP one byte tags (top bit set when the
+ * slot is used, the rest are high hash bits) and a group is matched with one
+ * compare. a slot holds the wordpool index of its word. each worker keeps
+ * one and reuses it from one document to the next.
+ */
+struct wordset {
+	u8 *tags;
+	u32 *slots;
+	u32 nr_groups; /* power of two, sized for the current document */
+	u32 cap_groups;
+};
+
+/**
+ * implicit trie of the unique words of a document: the words in
+ * lexicographic order, each with the length of the prefix it shares with the
+ * previous one. walking the array in order is a depth first traversal.
+ */
+struct doctrie {
+	int num;
+	const char **words; /* packed words, see strent->words */
+	u8 *lens;
+	u8 *lcp;
 };
 
 /**
@@ -27,10 +72,51 @@ struct strent {
 struct docent {
 	struct strent* strents; /* buckets */
 	char** strpool; /* strpool or ptr pool? @_@ */
-	char* doc_str; /* borrowed reference, do not free it */
+	word_t *wordpool; /* backing store of strent->words */
+	u64 *hashpool; /* backing store of strent->hashes */
+	struct charsig *sigpool; /* backing store of strent->sigs */
+	u32 *idpool; /* backing store of strent->ids */
+	int dict_complete; /* every word has a dictionary id */
+	struct wordset *set; /* borrowed from the worker */
+	struct arena *arena; /* backs the docent and all its pools */
+	u64 *bloom; /* DOC_BLOOM_BLOCK_BITS / 64 words per block */
+	u32 bloom_mask; /* number of blocks - 1 */
+	struct doctrie *trie; /* NULL for small documents */
+	int nr_words; /* number of unique words */
+	const char* doc_str; /* borrowed reference, do not free it */
+};
+
+/**
+ * a document fed in chunks. the words are deduped through the word set as
+ * they come in and staged in arrival order; docent_stream_end() lays them
+ * out in buckets.
+ */
+struct doc_stream {
+	struct docent *docent;
+	word_t *words;
+	u64 *hashes;
+	u8 *lens;
+	int nr_words;
+	int cap;
+	char carry[MAX_WORD_LENGTH + 1]; /* word cut by the end of a chunk */
+	int carry_len;
 };
 
-struct docent *docent_new(char *doc_str);
+void wordset_destroy(struct wordset *set);
+int  wordset_contains(struct docent *ent, const char *word, u64 hash);
+
+/* `doc_str` is only read, it need not be NUL terminated. `set` is cleared
+ * and holds the words of the document until the next docent_new on it.
+ * the docent is carved out of `arena`, docent_destroy() resets it */
+struct docent *docent_new(const char *doc_str, int doc_len,
+			  struct wordset *set, struct arena *arena);
 void           docent_destroy(struct docent *ent);
 
+/* docent_new() in pieces, the chunks may split words anywhere */
+void           docent_stream_begin(struct doc_stream *stream,
+				   struct wordset *set, struct arena *arena);
+void           docent_stream_feed(struct doc_stream *stream,
+				  const char *chunk, int len);
+struct docent *docent_stream_end(struct doc_stream *stream);
+
 #endif // __SIGMOD_DOCUMENT_H_
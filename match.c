@@ -1,27 +1,140 @@
 #include <limits.h>
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 #include "btree.h"
 #include "match.h"
+#include "worker.h"
 #include "core.h"
 
 /**
  * create a document_match object -- take a snapshot of the current plan.
  */
-void match_init(struct document_match *match, DocID doc_id, const char *doc_str)
+void match_init(struct document_match *match, DocID doc_id, const char *doc_str,
+		int doc_len, DocReleaseFn release, void *release_arg)
 {
 	/* op_rank is highly contented, needs to be created in a threaded
 	 * environment */
 	match->op_rank = NULL;
+	match->batches = NULL;
 	// match->query_mask = btree_cow_new(plan->query_mask);
-	// strncpy(match->doc_str, doc_str, MAX_DOC_LENGTH);
-	memcpy(match->doc_str, doc_str, strlen(doc_str) + 1);
+	match->doc_str = doc_str;
+	match->doc_len = doc_len;
+	match->release = release;
+	match->release_arg = release_arg;
 	/* docent_new is slow, create it in a threaded environment */
 	match->docent = NULL;
 	match->doc_id = doc_id;
 	match->shadow_id = -1;
+	match->stream = NULL;
+	match->bloom_probes = 0;
+	match->bloom_negatives = 0;
+	match->bloom_false_pos = 0;
+}
+
+/* hand the document buffer back, the match only needs its docent now */
+void match_release(struct document_match *match)
+{
+	if (match->release != NULL)
+		match->release(match->doc_str, match->release_arg);
+	match->doc_str = NULL;
+}
+
+struct match_stream *match_stream_new(struct document_match *match,
+				     DocID doc_id)
+{
+	struct match_stream *stream = malloc(sizeof(struct match_stream));
+	pthread_mutex_init(&stream->mutex, NULL);
+	list_init(&stream->chunks);
+	stream->ended = 0;
+	stream->queued = 0;
+	stream->doc_id = doc_id;
+	stream->match = match;
+	stream->begun = 0;
+	memset(&stream->set, 0, sizeof(struct wordset));
+	arena_init(&stream->arena);
+	return stream;
+}
+
+static void match_stream_free(struct match_stream *stream)
+{
+	arena_destroy(&stream->arena);
+	wordset_destroy(&stream->set);
+	pthread_mutex_destroy(&stream->mutex);
+	free(stream);
+}
+
+/**
+ * the chunk is copied, the caller may reuse it right away. returns 1 when
+ * the caller has to put stream->match on the ring.
+ */
+int match_stream_append(struct match_stream *stream, const char *chunk,
+			int len)
+{
+	struct match_chunk *ent = malloc(sizeof(struct match_chunk) + len);
+	int queue = 0;
+
+	ent->len = len;
+	memcpy(ent->data, chunk, len);
+	pthread_mutex_lock(&stream->mutex);
+	list_add(&ent->head, &stream->chunks);
+	queue = !stream->queued;
+	stream->queued = 1;
+	pthread_mutex_unlock(&stream->mutex);
+	return queue;
+}
+
+/* same as match_stream_append(), the stream belongs to the workers now */
+int match_stream_end(struct match_stream *stream)
+{
+	int queue = 0;
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->ended = 1;
+	queue = !stream->queued;
+	stream->queued = 1;
+	pthread_mutex_unlock(&stream->mutex);
+	return queue;
+}
+
+/**
+ * tokenize and dedup the chunks that are there. returns 0 if the document
+ * is not complete yet, it is off the ring until more comes in; else the
+ * docent is built and 1 is returned.
+ */
+int match_stream_feed(struct document_match *match,
+		      struct worker_manager *mgr)
+{
+	struct match_stream *stream = match->stream;
+	struct match_chunk *ent = NULL;
+	int ended = 0;
+
+	if (!stream->begun) {
+		docent_stream_begin(&stream->builder, &stream->set,
+				    &stream->arena);
+		stream->begun = 1;
+	}
+	for (;;) {
+		pthread_mutex_lock(&stream->mutex);
+		if (list_empty(&stream->chunks)) {
+			ended = stream->ended;
+			stream->queued = ended;
+			pthread_mutex_unlock(&stream->mutex);
+			break;
+		}
+		ent = container_of(stream->chunks.prev, struct match_chunk,
+				   head);
+		list_del(&ent->head);
+		pthread_mutex_unlock(&stream->mutex);
+		docent_stream_feed(&stream->builder, ent->data, ent->len);
+		worker_manager_unreserve(mgr, ent->len);
+		free(ent);
+	}
+	if (ended)
+		match->docent = docent_stream_end(&stream->builder);
+	return ended;
 }
 
 /**
@@ -204,17 +317,14 @@ static int match_exec_round(struct document_match *match, struct operator *op,
 	result->dis_calc_cnt[shadow->ctx.level]++;
 	if (shadow->ctx.need_hamming) {
 		/* calculate hamming distance */
-		shadow->ctx.min_distance = match_min_dist(match, 1,
-							  op->word,
-							  op->len, 1,
+		shadow->ctx.min_distance = match_min_dist(match, 1, op, 1,
 							  MAX_DIST + 1);
 		if (!need_to_reduce_distance(match, shadow->ctx.min_distance,
 					     shadow, 2, &lower_bound))
 			goto done_exclude;
 	}
 	shadow->ctx.min_distance = match_min_dist(match, shadow->ctx.level,
-						  op->word,
-						  op->len, lower_bound,
+						  op, lower_bound,
 						  shadow->ctx.min_distance);
 	if (shadow->ctx.min_distance > MAX_DIST)
 		shadow->ctx.min_distance = MAX_DIST + 1;
@@ -233,8 +343,7 @@ static int match_exec_round(struct document_match *match, struct operator *op,
 		struct operator_shadow *dirty_shadow =
 			container_of(entry, struct operator_shadow, dirty_ops);
 		struct operator *dirty_op =
-			(void*) ((u8*) dirty_shadow
-				 - match->shadow_id * sizeof(struct operator_shadow));
+			operator_of_shadow(dirty_shadow, match->shadow_id);
 		struct refcnt_operator_key key = {
 			dirty_shadow->refcnt, dirty_op
 		};
@@ -291,6 +400,248 @@ static void match_reschedule_operator(struct document_match *match,
 	btree_insert(match->op_rank, &key, &dummy);
 }
 
+/* size and reset the per document operator distance table */
+static void match_prepare_op_dist(struct document_match *match,
+				  int shadow_id)
+{
+	struct plan *plan = plan_get();
+	int nr_slots = plan->nr_batches * BATCH_LANES;
+
+	if (plan->op_dist_cap[shadow_id] < nr_slots) {
+		free(plan->op_dist_mem[shadow_id]);
+		plan->op_dist_mem[shadow_id] = malloc(nr_slots * 2);
+		plan->op_dist_cap[shadow_id] = nr_slots;
+	}
+	match->op_dist = plan->op_dist_mem[shadow_id];
+	memset(match->op_dist, OP_DIST_UNKNOWN, nr_slots * 2);
+}
+
+/* set, or clear again, the dictionary ids of the document in the bitmap */
+static void match_dict_members(struct document_match *match, int set)
+{
+	struct docent *docent = match->docent;
+	u8 *members = plan_get()->dict_members[match->shadow_id];
+	int i = 0, j = 0;
+
+	if (!WORD_DICT || !docent->dict_complete)
+		return;
+	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
+		struct strent *strent = &docent->strents[i];
+		for (j = 0; j < strent->num; j++) {
+			if (set)
+				bitmap_set_bit(members, strent->ids[j]);
+			else
+				bitmap_clear_bit(members, strent->ids[j]);
+		}
+	}
+}
+
+static void reverse_match_hit(void *value, int hamming, int edit, void *arg)
+{
+	struct document_match *match = arg;
+	struct operator *op = value;
+	u8 *dist = match->op_dist[op->slot];
+
+	if (hamming < dist[0])
+		dist[0] = hamming;
+	if (edit < dist[1])
+		dist[1] = edit;
+}
+
+/**
+ * when the operator vocabulary is much larger than the document's, probe
+ * the operator trie with every unique doc word instead: afterwards every
+ * operator has its exact hamming and edit distance in op_dist.
+ */
+static int match_reverse_prepare(struct document_match *match)
+{
+	struct plan *plan = plan_get();
+	struct docent *docent = match->docent;
+	int nr_slots = plan->nr_batches * BATCH_LANES;
+	int i = 0, j = 0;
+
+	if (plan->op_rank->sb.size < OPTRIE_MIN_RATIO * docent->nr_words)
+		return 0;
+	memset(match->op_dist, MAX_DIST + 1, nr_slots * 2);
+	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
+		struct strent *strent = &docent->strents[i];
+		for (j = 0; j < strent->num; j++) {
+			optrie_match(&plan->op_trie, strent->words[j],
+				     i + MIN_WORD_LENGTH, MAX_DIST,
+				     reverse_match_hit, match);
+		}
+	}
+	return 1;
+}
+
+/* record an exact distance over a missing value or a lower bound */
+static inline void match_record_dist(struct document_match *match,
+				     struct operator *op, int level, int dist)
+{
+	u8 *d = &match->op_dist[op->slot][level];
+
+	if (OP_DIST_IS_BOUND(*d) || dist < *d)
+		*d = dist;
+}
+
+static void deletion_match_hit(struct operator *op, int dist, void *arg)
+{
+	match_record_dist(arg, op, 1, dist);
+}
+
+static void segment_match_hit(struct operator *op, int dist, void *arg)
+{
+	match_record_dist(arg, op, 0, dist);
+}
+
+/**
+ * with many edit operators, probe the deletion index with every unique doc
+ * word: an indexed operator gets its exact edit distance if it is within
+ * its delete_depth, otherwise a lower bound that settles it.
+ */
+static void match_deletion_prepare(struct document_match *match)
+{
+	struct plan *plan = plan_get();
+	struct docent *docent = match->docent;
+	struct list_head *entry = NULL;
+	int i = 0, j = 0;
+
+	if (DELETE_INDEX_DEPTH == 0
+	    || plan->nr_delete_ops < DELETE_INDEX_MIN_RATIO * docent->nr_words)
+		return;
+	for (entry = plan->delete_ops.next; entry != &plan->delete_ops;
+	     entry = entry->next) {
+		struct operator *op =
+			container_of(entry, struct operator, delete_head);
+		match->op_dist[op->slot][1] =
+			OP_DIST_AT_LEAST(op->delete_depth + 1);
+	}
+	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
+		struct strent *strent = &docent->strents[i];
+		for (j = 0; j < strent->num; j++) {
+			plan_probe_deletions(plan, strent->words[j],
+					     i + MIN_WORD_LENGTH,
+					     deletion_match_hit, match);
+		}
+	}
+}
+
+/**
+ * same for the hamming distances through the segment index. the need_hamming
+ * prefetch of the edit level reads them from op_dist as well.
+ */
+static void match_segment_prepare(struct document_match *match)
+{
+	struct plan *plan = plan_get();
+	struct docent *docent = match->docent;
+	struct list_head *entry = NULL;
+	int i = 0, j = 0;
+
+	if (plan->nr_segment_ops < SEGMENT_INDEX_MIN_OPS)
+		return;
+	for (entry = plan->segment_ops.next; entry != &plan->segment_ops;
+	     entry = entry->next) {
+		struct operator *op =
+			container_of(entry, struct operator, segment_head);
+		match->op_dist[op->slot][0] =
+			OP_DIST_AT_LEAST(op->segment_k + 1);
+	}
+	for (i = 0; i < WORD_LENGTH_RANGE; i++) {
+		struct strent *strent = &docent->strents[i];
+		for (j = 0; j < strent->num; j++) {
+			plan_probe_segments(plan, strent->words[j],
+					    i + MIN_WORD_LENGTH,
+					    segment_match_hit, match);
+		}
+	}
+}
+
+/* exact distances of the lanes of `batch` at the levels they are used at */
+static void match_prefill_batch(struct document_match *match,
+				struct op_batch *batch)
+{
+	int i = 0, j = 0, level = 0;
+
+	for (i = 0; i < BATCH_LANES; i++) {
+		struct operator *op = batch->ops[i];
+		if (op == NULL)
+			continue;
+		for (level = 0; level < 2; level++) {
+			int mt = MT_HAMMING_DIST + level;
+			int used = 0;
+			u8 dist = match->op_dist[op->slot][level];
+			for (j = 0; j < 4; j++)
+				used |= op->nr_refs[mt][j];
+			if (!used || !(dist == OP_DIST_UNKNOWN
+				       || OP_DIST_IS_BOUND(dist)))
+				continue;
+			match->op_dist[op->slot][level] =
+				match_min_dist(match, mt, op, 0, MAX_DIST + 1);
+		}
+	}
+}
+
+/* the task still counts in nr_tasks, see worker_manager_task_done() */
+void match_run_task(struct match_task *task)
+{
+	struct match_job *job = task->job;
+
+	if (!job->done)
+		match_prefill_batch(job->match, job->match->batches[task->batch]);
+}
+
+struct match_order {
+	u8 *seen;
+	struct match_task *tasks;
+	struct match_job *job;
+	int nr;
+};
+
+static int match_order_callback(struct btree *tree, struct btree_node *node,
+				void *key, void *ptr)
+{
+	struct match_order *order = ptr;
+	struct operator *op = ((struct refcnt_operator_key *) key)->operator;
+
+	if (node->header.level != 0 || op->batch == NULL
+	    || order->seen[op->batch->id])
+		return 0;
+	order->seen[op->batch->id] = 1;
+	order->tasks[order->nr].job = order->job;
+	order->tasks[order->nr++].batch = op->batch->id;
+	return 0;
+}
+
+/**
+ * one task per batch, in the order the owner first meets the batches when
+ * it walks op_rank. returns 0 when nobody is there to steal them.
+ */
+static int match_share(struct document_match *match, struct match_job *job,
+		       struct worker_manager *mgr)
+{
+	struct plan *plan = plan_get();
+	struct arena *arena = match->docent->arena;
+	struct match_order order;
+	int nr_helpers = worker_manager_nr_helpers(mgr);
+
+	if (nr_helpers == 0 || plan->nr_batches == 0)
+		return 0;
+	order.seen = arena_alloc(arena, plan->nr_batches, 8);
+	memset(order.seen, 0, plan->nr_batches);
+	order.tasks = arena_alloc(arena, plan->nr_batches
+				  * sizeof(struct match_task), 8);
+	order.job = job;
+	order.nr = 0;
+	btree_visit(match->op_rank, NULL, match_order_callback, NULL, &order);
+
+	job->match = match;
+	job->tasks = order.tasks;
+	job->done = 0;
+	worker_manager_share(mgr, match->shadow_id, job, order.nr,
+			     nr_helpers);
+	return 1;
+}
+
 static int collect_qid_callback(struct btree *tree, struct btree_node *node,
 				void *key, void *ptr)
 {
@@ -303,9 +654,35 @@ static int collect_qid_callback(struct btree *tree, struct btree_node *node,
 	return 0;
 }
 
-void match_exec(struct document_match *match, struct match_result *result,
-		int shadow_id)
+/**
+ * build the docent of the `idx`-th document a worker holds, a stream has
+ * it from match_stream_feed(). the buffer is released right after, and its
+ * bytes go back to the admission budget
+ */
+static void match_load(struct document_match *match, int shadow_id, int idx,
+		       struct worker_manager *mgr)
+{
+	match->shadow_id = shadow_id;
+	if (match->stream == NULL)
+		match->docent = docent_new(match->doc_str, match->doc_len,
+					   plan_doc_words(plan_get(),
+							  shadow_id, idx),
+					   &plan_get()->doc_arena[shadow_id]);
+	match_release(match);
+	worker_manager_unreserve(mgr, match->doc_len);
+}
+
+/**
+ * the adaptive loop over a loaded document. with `prepared` op_dist is
+ * already filled in with exact distances, see match_exec_batch(). the
+ * docent is left to the caller.
+ */
+static void match_run(struct document_match *match,
+		      struct match_result *result, int shadow_id,
+		      struct worker_manager *mgr, int prepared)
 {
+	struct match_job job;
+	int shared = 0;
 	struct operator *op = NULL;
 	struct operator_shadow *shadow = NULL;
 	struct list_head zombies;
@@ -320,12 +697,22 @@ void match_exec(struct document_match *match, struct match_result *result,
 	result->range.min_qid = INT_MAX;
 	result->range.max_qid = 0;
 	result->nr_queries = plan_get()->query_table->sb.size;
-	match->shadow_id = shadow_id;
-	match->docent = docent_new(match->doc_str);
 	/* create a shadow */
-	match->op_rank = btree_cow_new(plan_get()->op_rank,
+	match->op_rank = btree_cow_new(plan_op_rank(plan_get(), shadow_id),
 				       &plan_get()->shadow_mempool[shadow_id]);
+	match->batches = plan_batches(plan_get(), shadow_id);
 	match->bitmap = plan_get()->bitmap_mem[shadow_id];
+	match_dict_members(match, 1);
+	if (!prepared) {
+		match_prepare_op_dist(match, shadow_id);
+		if (!match_reverse_prepare(match)) {
+			match_deletion_prepare(match);
+			match_segment_prepare(match);
+		}
+	}
+	/* op_dist is set up, from here on it only gets exact distances */
+	if (match->docent->nr_words >= MATCH_SPLIT_MIN_WORDS)
+		shared = match_share(match, &job, mgr);
 	// printf("start matching...\n");
 	while (match->op_rank->sb.size > 0) {
 		op = match_pick_operator(match);
@@ -355,15 +742,15 @@ void match_exec(struct document_match *match, struct match_result *result,
 			goto exec;
 		}
 	}
+	if (shared)
+		worker_manager_unshare(mgr, shadow_id, &job);
 
 	entry = zombies.next;
 	while (entry != &zombies) {
 		struct operator_shadow *shadow =
 			container_of(entry, struct operator_shadow,
 				     zombie_list);
-		struct operator *op =
-			(void*) ((u8*) shadow
-				 - shadow_id * sizeof(struct operator_shadow));
+		struct operator *op = operator_of_shadow(shadow, shadow_id);
 		entry = shadow->zombie_list.next;
 		list_del(&shadow->zombie_list);
 		operator_destroy_shadow(op, shadow_id);
@@ -383,8 +770,7 @@ void match_exec(struct document_match *match, struct match_result *result,
 		struct query_shadow *shadow =
 			container_of(entry, struct query_shadow, head);
 		struct query_struct *qstruct =
-			(void*) ((u8*) shadow
-				 - shadow_id * sizeof(struct query_shadow));
+			query_of_shadow(shadow, shadow_id);
 		entry = shadow->head.next;
 		list_del(&shadow->head);
 		query_destroy_shadow(qstruct, shadow_id);
@@ -397,10 +783,203 @@ void match_exec(struct document_match *match, struct match_result *result,
 		}
 	}
 	qsort(result->queries, result->nr_queries, sizeof(int), uint_compare);
-	bitmap_reset_range(match->bitmap, result->range.min_qid,
-	 		   result->range.max_qid);
+	/* the range stays empty when no query failed */
+	if (result->range.min_qid <= result->range.max_qid)
+		bitmap_reset_range(match->bitmap, result->range.min_qid,
+				   result->range.max_qid);
+
+	__sync_fetch_and_add(&plan_get()->bloom_probes, match->bloom_probes);
+	__sync_fetch_and_add(&plan_get()->bloom_negatives,
+			     match->bloom_negatives);
+	__sync_fetch_and_add(&plan_get()->bloom_false_pos,
+			     match->bloom_false_pos);
 
 	/* free up thread specific resources */
+	match_dict_members(match, 0);
 	btree_cow_destroy(match->op_rank);
+}
+
+void match_exec(struct document_match *match, struct match_result *result,
+		int shadow_id, struct worker_manager *mgr)
+{
+	match_load(match, shadow_id, 0, mgr);
+	match_run(match, result, shadow_id, mgr, 0);
 	docent_destroy(match->docent);
+	if (match->stream != NULL) {
+		match_stream_free(match->stream);
+		match->stream = NULL;
+	}
+}
+
+/* a word of the batch vocabulary and the documents it is in */
+struct batch_word {
+	const char *word; /* packed, see strent->words */
+	u64 hash;
+	u64 docs;
+	int len;
+};
+
+/* the documents an operator slot is at each hamming and edit distance of */
+struct batch_dist {
+	u64 docs[2][MAX_DIST + 1];
+};
+
+struct match_batch {
+	struct document_match **matches;
+	int nr;
+	struct batch_word *words; /* open addressing on the hash */
+	u32 mask;
+	int nr_words;
+	struct batch_dist *dist; /* per slot, valid once touched */
+	u8 *touched;
+	int *touched_slots;
+	int nr_touched;
+	u64 docs; /* of the word being probed */
+};
+
+static void batch_add_word(struct match_batch *batch, const char *word,
+			   int len, u64 hash, int doc)
+{
+	u32 i = hash & batch->mask;
+
+	for (;; i = (i + 1) & batch->mask) {
+		struct batch_word *ent = &batch->words[i];
+		if (ent->word == NULL) {
+			ent->word = word;
+			ent->hash = hash;
+			ent->len = len;
+			ent->docs = 1ULL << doc;
+			batch->nr_words++;
+			return;
+		}
+		if (ent->hash == hash && ent->len == len
+		    && !memcmp(ent->word, word, sizeof(word_t))) {
+			ent->docs |= 1ULL << doc;
+			return;
+		}
+	}
+}
+
+static void batch_match_hit(void *value, int hamming, int edit, void *arg)
+{
+	struct match_batch *batch = arg;
+	struct operator *op = value;
+	struct batch_dist *dist = &batch->dist[op->slot];
+
+	if (!batch->touched[op->slot]) {
+		batch->touched[op->slot] = 1;
+		batch->touched_slots[batch->nr_touched++] = op->slot;
+		memset(dist, 0, sizeof(struct batch_dist));
+	}
+	if (hamming <= MAX_DIST)
+		dist->docs[0][hamming] |= batch->docs;
+	if (edit <= MAX_DIST)
+		dist->docs[1][edit] |= batch->docs;
+}
+
+/**
+ * the union vocabulary of the loaded documents, with a bitset of the
+ * documents each word is in. when probing the operator trie once per union
+ * word is cheaper than what the documents would do on their own (the
+ * OPTRIE_MIN_RATIO cost model of match_reverse_prepare()), every document
+ * gets its exact op_dist out of the hits and 1 is returned.
+ */
+static int match_batch_prepare(struct document_match **matches, int nr,
+			       int shadow_id)
+{
+	struct plan *plan = plan_get();
+	struct arena *arena = &plan->doc_arena[shadow_id];
+	int nr_slots = plan->nr_batches * BATCH_LANES;
+	long nr_ops = plan->op_rank->sb.size, alone = 0;
+	struct match_batch batch;
+	int i = 0, j = 0, k = 0, level = 0, total = 0, largest = 0;
+
+	for (i = 0; i < nr; i++) {
+		long words = matches[i]->docent->nr_words;
+		total += words;
+		if (words > largest)
+			largest = words;
+		alone += nr_ops < OPTRIE_MIN_RATIO * words
+			? nr_ops : OPTRIE_MIN_RATIO * words;
+	}
+	/* the union is at least the largest document */
+	if (OPTRIE_MIN_RATIO * (long) largest > alone)
+		return 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.matches = matches;
+	batch.nr = nr;
+	for (batch.mask = 1; batch.mask < 2 * (u32) total; batch.mask <<= 1)
+		;
+	batch.words = arena_alloc(arena, batch.mask
+				  * sizeof(struct batch_word), 64);
+	memset(batch.words, 0, batch.mask * sizeof(struct batch_word));
+	batch.mask--;
+	for (i = 0; i < nr; i++) {
+		struct docent *docent = matches[i]->docent;
+		for (j = 0; j < WORD_LENGTH_RANGE; j++) {
+			struct strent *strent = &docent->strents[j];
+			for (k = 0; k < strent->num; k++)
+				batch_add_word(&batch, strent->words[k],
+					       j + MIN_WORD_LENGTH,
+					       strent->hashes[k], i);
+		}
+	}
+	if (OPTRIE_MIN_RATIO * (long) batch.nr_words > alone)
+		return 0;
+
+	batch.dist = arena_alloc(arena, nr_slots * sizeof(struct batch_dist),
+				 64);
+	batch.touched = arena_alloc(arena, nr_slots, 64);
+	memset(batch.touched, 0, nr_slots);
+	batch.touched_slots = arena_alloc(arena, nr_slots * sizeof(int), 64);
+	for (i = 0; i <= (int) batch.mask; i++) {
+		struct batch_word *ent = &batch.words[i];
+		if (ent->word == NULL)
+			continue;
+		batch.docs = ent->docs;
+		optrie_match(&plan->op_trie, ent->word, ent->len, MAX_DIST,
+			     batch_match_hit, &batch);
+	}
+
+	for (i = 0; i < nr; i++) {
+		matches[i]->op_dist = arena_alloc(arena, nr_slots * 2, 64);
+		memset(matches[i]->op_dist, MAX_DIST + 1, nr_slots * 2);
+	}
+	/* the largest distance first, the smallest one of a document wins */
+	for (i = 0; i < batch.nr_touched; i++) {
+		int slot = batch.touched_slots[i];
+		struct batch_dist *dist = &batch.dist[slot];
+		for (level = 0; level < 2; level++) {
+			for (k = MAX_DIST; k >= 0; k--) {
+				u64 docs = dist->docs[level][k];
+				while (docs != 0) {
+					j = __builtin_ctzll(docs);
+					docs &= docs - 1;
+					matches[j]->op_dist[slot][level] = k;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+/**
+ * match `nr` queued documents together. the documents are loaded side by
+ * side, so the distance work can be done once over their union
+ * vocabulary, then each goes through its own adaptive loop.
+ */
+void match_exec_batch(struct document_match **matches,
+		      struct match_result **results, int nr, int shadow_id,
+		      struct worker_manager *mgr)
+{
+	int i = 0, prepared = 0;
+
+	for (i = 0; i < nr; i++)
+		match_load(matches[i], shadow_id, i, mgr);
+	prepared = nr > 1 && match_batch_prepare(matches, nr, shadow_id);
+	for (i = 0; i < nr; i++)
+		match_run(matches[i], results[i], shadow_id, mgr, prepared);
+	/* they share the arena, one reset frees them all */
+	docent_destroy(matches[0]->docent);
 }
@@ -1,11 +1,70 @@
 #ifndef _MATCH_H_
 #define _MATCH_H_
 
+#include <pthread.h>
+
 #include "misc.h"
 #include "core.h"
 #include "operator.h"
 #include "document.h"
 
+struct match_chunk {
+	struct list_head head;
+	int len;
+	char data[];
+};
+
+/**
+ * the chunks of a document still being appended. the document is on the
+ * ring only while it has chunks to feed: a worker feeds what is there and
+ * goes back to the ring, the next chunk queues it again. the docent grows
+ * in the stream's own word set and arena, so any worker can go on with it.
+ * the document is complete once `ended` is set and the list is drained.
+ */
+struct match_stream {
+	pthread_mutex_t mutex;
+	struct list_head chunks;
+	int ended;
+	int queued; /* on the ring or with a worker */
+	DocID doc_id;
+	struct document_match *match;
+	struct list_head head; /* head on the list of open documents */
+	struct doc_stream builder;
+	int begun; /* builder started, by the first worker */
+	struct wordset set;
+	struct arena arena;
+};
+
+struct worker_manager;
+
+/* documents with this many unique words put their distance work up for
+ * stealing, and wake at most this many parked workers for it */
+#define MATCH_SPLIT_MIN_WORDS 4096
+#define MATCH_SPLIT_MAX_HELPERS 4
+
+struct match_job;
+
+/* the distances of one operator batch, the unit a thief takes */
+struct match_task {
+	struct match_job *job;
+	int batch;
+};
+
+/**
+ * the distance work of a document, up for stealing. the owner pushes a task
+ * per batch on its deque in op_rank order, the batch it needs last on top,
+ * so thieves work from the far end while the owner runs the usual adaptive
+ * loop from the near end and mostly finds its distances already there.
+ * thieves only ever store exact distances. a task counts in nr_tasks until
+ * whoever took it is done with it, the job lives until that is zero.
+ */
+struct match_job {
+	struct document_match *match;
+	struct match_task *tasks;
+	volatile int nr_tasks;
+	volatile int done; /* the owner is finished, skip what is left */
+};
+
 /**
  * this represent the internal data structure of a document. we might
  * need to build some sort of index for document to speed up the matching
@@ -21,15 +80,41 @@ struct document_match {
  	 * op_rank key is a "<refcnt, ptr>", value is useless, a cow tree
  	 */
  	struct btree *op_rank;
+	struct op_batch **batches; /* plan_batches() of the shadow */
 	DocID doc_id;
 	int shadow_id;
 	struct plan *plan; /* backref */
 
-	struct list_head head; /* head on the global queue */
-	char doc_str[MAX_DOC_LENGTH];
+	/* min hamming/edit distance of each operator slot, OP_DIST_UNKNOWN
+	 * until its batch has been evaluated */
+	u8 (*op_dist)[2];
+
+	/* the document, owned by the caller until release is called */
+	const char *doc_str;
+	int doc_len;
+	DocReleaseFn release;
+	void *release_arg;
+	/* NULL unless the document is appended in chunks */
+	struct match_stream *stream;
+	/* exact match lookups, added to the plan totals when done */
+	unsigned long bloom_probes;
+	unsigned long bloom_negatives;
+	unsigned long bloom_false_pos;
 	u8 *bitmap;
 };
 
+#define OP_DIST_UNKNOWN 0xff
+/* only a lower bound is known: the operator was missed by an index */
+#define OP_DIST_AT_LEAST(d) (0x80 | (d))
+#define OP_DIST_IS_BOUND(d) (((d) & 0x80) && (d) != OP_DIST_UNKNOWN)
+
+/* a batch needs this many live lanes before the batch kernels are used */
+#define OP_BATCH_MIN_OPS 4
+
+/* match doc words against the operator trie once the live operators
+ * outnumber the unique words of the document by this factor */
+#define OPTRIE_MIN_RATIO 64
+
 struct match_result {
 	unsigned int doc_id;
 	int nr_queries;
@@ -46,7 +131,6 @@ struct match_result {
 	} range;
 
 	struct document_match *match;
-	struct list_head head;
 };
 
 /**
@@ -55,18 +139,34 @@ struct match_result {
  * @doc_id the document id
  * @match_type MATCH TYPE, it could be MT_EXTACT_MATCH,
  * MT_HAMMING_DIST or MT_EDIT_DIST
- * @match_dist match distance
- * @word the query word.
+ * @op the operator holding the query word and its precomputed masks
+ * @lower_bound stop as soon as a distance <= lower_bound is found
+ * @upper_bound the current best distance
  *
  * @return the minimum distance to the target word specified.
  *
  */
 int match_min_dist(struct document_match *match, MatchType match_type,
-		   const char *word, int len, int lower_bound, int upper_bound);
+		   struct operator *op, int lower_bound, int upper_bound);
+
+void match_init(struct document_match *match, DocID doc_id, const char *doc_str,
+		int doc_len, DocReleaseFn release, void *release_arg);
+void match_release(struct document_match *match);
 
-void match_init(struct document_match *match, DocID doc_id, const char *doc_str);
+struct match_stream *match_stream_new(struct document_match *match,
+				     DocID doc_id);
+int  match_stream_append(struct match_stream *stream, const char *chunk,
+			 int len);
+int  match_stream_end(struct match_stream *stream);
+int  match_stream_feed(struct document_match *match,
+		       struct worker_manager *mgr);
 
 void            match_exec(struct document_match *match,
-			   struct match_result *result, int shadow_id);
+			   struct match_result *result, int shadow_id,
+			   struct worker_manager *mgr);
+void            match_exec_batch(struct document_match **matches,
+				 struct match_result **results, int nr,
+				 int shadow_id, struct worker_manager *mgr);
+void            match_run_task(struct match_task *task);
 
 #endif /* _MATCH_H_ */
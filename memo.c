@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memo.h"
+
+void memo_init(struct memo_cache *memo, unsigned long nr_sets)
+{
+	size_t size = 0;
+
+	memset(memo, 0, sizeof(struct memo_cache));
+	memo->nr_sets = nr_sets;
+	if (nr_sets == 0)
+		return;
+	size = nr_sets * MEMO_WAYS * sizeof(struct memo_entry);
+	if (posix_memalign((void **) &memo->slots, 64, size) != 0)
+		abort();
+	memset(memo->slots, 0, size);
+}
+
+void memo_destroy(struct memo_cache *memo)
+{
+	free(memo->slots);
+	memo->slots = NULL;
+}
+
+/**
+ * replace the entry of `key` if it is there, else take an empty way, else
+ * run the clock over the set: referenced ways lose their bit and are passed
+ * over, the first unreferenced one is evicted. returns 1 on eviction.
+ */
+static inline void memo_entry_store(struct memo_entry *way, u64 tag,
+				    u64 check)
+{
+	/* the check goes first, pairs with the acquire in memo_lookup() */
+	__atomic_store_n(&way->check, check, __ATOMIC_RELAXED);
+	__atomic_store_n(&way->tag, tag, __ATOMIC_RELEASE);
+}
+
+int memo_store(struct memo_cache *memo, u64 key, u64 check, int dist,
+	       int bound)
+{
+	struct memo_entry *set = memo_set(memo, key);
+	u64 entry = (key & MEMO_TAG_MASK) | (bound ? MEMO_BOUND : 0) | dist;
+	int hand = (key >> 40) & (MEMO_WAYS - 1);
+	int i = 0;
+
+	for (i = 0; i < MEMO_WAYS; i++) {
+		u64 slot = __atomic_load_n(&set[i].tag, __ATOMIC_RELAXED);
+		if (slot == 0
+		    || ((slot & MEMO_TAG_MASK) == (key & MEMO_TAG_MASK)
+			&& set[i].check == check)) {
+			memo_entry_store(&set[i], entry, check);
+			return 0;
+		}
+	}
+	for (i = 0; i < 2 * MEMO_WAYS; i++) {
+		struct memo_entry *way = &set[(hand + i) & (MEMO_WAYS - 1)];
+		u64 slot = __atomic_load_n(&way->tag, __ATOMIC_RELAXED);
+		if (slot & MEMO_REF) {
+			__atomic_compare_exchange_n(&way->tag, &slot,
+						    slot & ~MEMO_REF, 1,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+			continue;
+		}
+		memo_entry_store(way, entry, check);
+		return 1;
+	}
+	return 0;
+}
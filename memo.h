@@ -0,0 +1,135 @@
+#ifndef _MEMO_H_
+#define _MEMO_H_
+
+#include "misc.h"
+#include "core.h"
+#include "dict.h"
+
+/**
+ * sets of MEMO_WAYS entries, 0 disables the cache. only min_edit_strent()
+ * probes it, and with the dictionary the neighbourhoods, batches and
+ * reverse matching answer nearly every edit operator before that, so the
+ * cache is off then
+ */
+#define MEMO_SETS (WORD_DICT ? 0 : 1 << 18)
+#define MEMO_WAYS 4
+
+/**
+ * distance memo shared by all workers, keyed by the (operator word, doc
+ * word) pair. an entry is a tag and a check word, so readers and writers
+ * never lock: a racing update can only lose an entry or a reference bit.
+ *
+ * tag:
+ *   63..5 memo_key() of the pair, bit 63 always set so that 0 marks an
+ *         empty slot
+ *   4     clock reference bit
+ *   3     the distance is only a lower bound
+ *   2..0  distance, MAX_DIST + 1 at most
+ * check:
+ *   63..10 memo_check() hash of both words, independent of the key
+ *   9..5   length of the operator word
+ *   4..0   length of the doc word
+ *
+ * a hit must match both, the check word is written before the tag and read
+ * after it, so a torn entry of another pair fails the check.
+ */
+struct memo_entry {
+	volatile u64 tag;
+	volatile u64 check;
+};
+
+struct memo_cache {
+	struct memo_entry *slots;
+	unsigned long nr_sets;
+	volatile unsigned long hits;
+	volatile unsigned long misses;
+	volatile unsigned long evictions;
+};
+
+#define MEMO_TAG_MASK (~0x1fULL)
+#define MEMO_REF (1ULL << 4)
+#define MEMO_BOUND (1ULL << 3)
+#define MEMO_DIST_MASK 0x7ULL
+
+void memo_init(struct memo_cache *memo, unsigned long nr_sets);
+void memo_destroy(struct memo_cache *memo);
+int  memo_store(struct memo_cache *memo, u64 key, u64 check, int dist,
+		int bound);
+
+/* hash of a word zero-padded to sizeof(word_t) */
+static inline u64 memo_word_hash(const char *word)
+{
+	const u64 *p = (const u64 *) word;
+	u64 h = p[0] * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[1]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[2]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[3]) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static inline u64 memo_key(u64 op_hash, u64 word_hash)
+{
+	u64 h = (op_hash ^ (word_hash * 0xff51afd7ed558ccdULL))
+		* 0xc4ceb9fe1a85ec53ULL;
+	return (h ^ (h >> 32)) | (1ULL << 63);
+}
+
+/* second hash of the pair, over both words, zero-padded to sizeof(word_t) */
+static inline u64 memo_check(const char *op_word, int op_len,
+			     const char *word, int len)
+{
+	const u64 *p = (const u64 *) op_word;
+	const u64 *q = (const u64 *) word;
+	u64 h = 0x243f6a8885a308d3ULL;
+	int i = 0;
+
+	for (i = 0; i < 4; i++) {
+		h = (h ^ p[i]) * 0xd6e8feb86659fd93ULL;
+		h = (h ^ q[i] ^ (h >> 32)) * 0xd6e8feb86659fd93ULL;
+	}
+	return (h & ~0x3ffULL) | (op_len << 5) | len;
+}
+
+static inline struct memo_entry *memo_set(struct memo_cache *memo, u64 key)
+{
+	return &memo->slots[(key & (memo->nr_sets - 1)) * MEMO_WAYS];
+}
+
+static inline void memo_prefetch(struct memo_cache *memo, u64 key)
+{
+	__builtin_prefetch(memo_set(memo, key));
+}
+
+/**
+ * distance of the pair under the kernel contract for curr_dist: the exact
+ * distance if it is below curr_dist, MAX_DIST + 1 otherwise. -1 if the
+ * entry is missing or not precise enough.
+ */
+static inline int memo_lookup(struct memo_cache *memo, u64 key, u64 check,
+			      int curr_dist)
+{
+	struct memo_entry *set = memo_set(memo, key);
+	int i = 0;
+
+	for (i = 0; i < MEMO_WAYS; i++) {
+		u64 slot = __atomic_load_n(&set[i].tag, __ATOMIC_ACQUIRE);
+		int dist = 0;
+		if ((slot & MEMO_TAG_MASK) != (key & MEMO_TAG_MASK))
+			continue;
+		if (__atomic_load_n(&set[i].check, __ATOMIC_RELAXED) != check)
+			continue;
+		if (!(slot & MEMO_REF))
+			__atomic_compare_exchange_n(&set[i].tag, &slot,
+						    slot | MEMO_REF, 1,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+		dist = slot & MEMO_DIST_MASK;
+		if (!(slot & MEMO_BOUND))
+			return dist < curr_dist ? dist : MAX_DIST + 1;
+		/* at least dist: enough if nothing below curr_dist counts */
+		return dist >= curr_dist ? MAX_DIST + 1 : -1;
+	}
+	return -1;
+}
+
+#endif /* _MEMO_H_ */
@@ -10,6 +10,8 @@ struct mempool {
 	size_t chunk_size;
 	void *chunk_heads[MAX_CHUNK];
 	void *chunks[MAX_CHUNK];
+	/* bytes of a chunk handed out so far, the rest is not touched yet */
+	size_t chunk_used[MAX_CHUNK];
 };
 
 void mempool_init(struct mempool *pool, int obj_size, size_t chunk_size);
@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+/**
+ * parse a core list such as "0-3,8" into `cpus`, returns the number of
+ * cores or -1 when it is malformed or longer than `max`.
+ */
+int numa_parse_cpus(const char *list, int *cpus, int max)
+{
+	int nr = 0;
+	char *end = NULL;
+
+	while (*list != 0 && *list != '\n') {
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list || first < 0 || first >= NUMA_MAX_CPUS)
+			return -1;
+		list = end;
+		if (*list == '-') {
+			last = strtol(list + 1, &end, 10);
+			if (end == list + 1 || last < first
+			    || last >= NUMA_MAX_CPUS)
+				return -1;
+			list = end;
+		}
+		for (; first <= last; first++) {
+			if (nr == max)
+				return -1;
+			cpus[nr++] = first;
+		}
+		if (*list == ',')
+			list++;
+		else if (*list != 0 && *list != '\n')
+			return -1;
+	}
+	return nr;
+}
+
+/* the allowed cpus of a node's cpulist file, 0 when there is none */
+static int numa_read_node(int node, const cpu_set_t *allowed,
+			  struct numa_node *ent)
+{
+	char path[64], line[4096];
+	int cpus[NUMA_MAX_CPUS];
+	int nr = 0, i = 0;
+	FILE *f = NULL;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(line, sizeof(line), f) != NULL)
+		nr = numa_parse_cpus(line, cpus, NUMA_MAX_CPUS);
+	fclose(f);
+
+	ent->nr_cpus = 0;
+	ent->cpus = malloc(sizeof(int) * (nr > 0 ? nr : 1));
+	for (i = 0; i < nr; i++) {
+		if (CPU_ISSET(cpus[i], allowed))
+			ent->cpus[ent->nr_cpus++] = cpus[i];
+	}
+	if (ent->nr_cpus == 0) {
+		free(ent->cpus);
+		ent->cpus = NULL;
+	}
+	return ent->nr_cpus;
+}
+
+void numa_init(struct numa *numa)
+{
+	cpu_set_t allowed;
+	int i = 0;
+
+	memset(numa, 0, sizeof(struct numa));
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (i = 0; i < sysconf(_SC_NPROCESSORS_ONLN)
+			     && i < NUMA_MAX_CPUS; i++)
+			CPU_SET(i, &allowed);
+	}
+	numa->all.cpus = malloc(sizeof(int) * NUMA_MAX_CPUS);
+	for (i = 0; i < NUMA_MAX_CPUS; i++) {
+		if (CPU_ISSET(i, &allowed))
+			numa->all.cpus[numa->all.nr_cpus++] = i;
+	}
+
+	for (i = 0; i < NUMA_MAX_NODES; i++) {
+		if (numa_read_node(i, &allowed, &numa->nodes[numa->nr_nodes]))
+			numa->nr_nodes++;
+	}
+	if (numa->nr_nodes == 0) {
+		numa->nodes[0].cpus = malloc(sizeof(int) * numa->all.nr_cpus);
+		memcpy(numa->nodes[0].cpus, numa->all.cpus,
+		       sizeof(int) * numa->all.nr_cpus);
+		numa->nodes[0].nr_cpus = numa->all.nr_cpus;
+		numa->nr_nodes = 1;
+	}
+}
+
+void numa_destroy(struct numa *numa)
+{
+	int i = 0;
+	for (i = 0; i < numa->nr_nodes; i++)
+		free(numa->nodes[i].cpus);
+	free(numa->all.cpus);
+	memset(numa, 0, sizeof(struct numa));
+}
+
+/* 0 for a cpu that is on no node we know */
+int numa_node_of_cpu(struct numa *numa, int cpu)
+{
+	int i = 0, j = 0;
+	for (i = 0; i < numa->nr_nodes; i++) {
+		for (j = 0; j < numa->nodes[i].nr_cpus; j++) {
+			if (numa->nodes[i].cpus[j] == cpu)
+				return i;
+		}
+	}
+	return 0;
+}
+
+void numa_run_on(struct numa *numa, int node)
+{
+	struct numa_node *ent = node < 0 ? &numa->all : &numa->nodes[node];
+	cpu_set_t set;
+	int i = 0;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < ent->nr_cpus; i++)
+		CPU_SET(ent->cpus[i], &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
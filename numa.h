@@ -0,0 +1,35 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+/* nodes we look for under /sys/devices/system/node */
+#define NUMA_MAX_NODES 64
+/* cpus in a core list, the size of a cpu_set_t */
+#define NUMA_MAX_CPUS 1024
+
+/* the cpus of a node we are allowed to run on */
+struct numa_node {
+	int *cpus;
+	int nr_cpus;
+};
+
+/**
+ * the nodes of the machine as the kernel reports them, without libnuma.
+ * nodes without an allowed cpu are left out, so node ids here are dense
+ * and may differ from the kernel's. a machine without the sysfs files is
+ * one node.
+ */
+struct numa {
+	int nr_nodes;
+	struct numa_node nodes[NUMA_MAX_NODES];
+	struct numa_node all; /* every cpu allowed at numa_init() */
+};
+
+int  numa_parse_cpus(const char *list, int *cpus, int max);
+void numa_init(struct numa *numa);
+void numa_destroy(struct numa *numa);
+int  numa_node_of_cpu(struct numa *numa, int cpu);
+/* move the calling thread to `node`, or back to every cpu for -1. the
+ * memory it touches first from then on is placed on that node */
+void numa_run_on(struct numa *numa, int node);
+
+#endif /* _NUMA_H_ */
@@ -24,6 +24,30 @@ unsigned long word_hash(const void *key)
 	return p[0] ^ p[1] ^ p[2];
 }
 
+static unsigned long variant_hash(const void *key)
+{
+	const u64 *p = key;
+	u64 h = p[0] * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[1]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[2]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[3]) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static unsigned long segment_hash(const void *key)
+{
+	const u64 *p = key;
+	u64 h = p[0] * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[1]) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p[2]) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static int segment_compare(const void *p, const void *q)
+{
+	return memcmp(p, q, sizeof(struct segment_key));
+}
+
 int refcnt_operator_compare(const void *p, const void *q)
 {
 	const struct refcnt_operator_key *a = p;
@@ -99,7 +123,22 @@ unsigned long query_dedup_hash(const void *p)
 	return base;
 }
 
-void plan_init(struct plan *plan)
+/* the structs end with one shadow per worker */
+#define SHADOWED_SIZE(type, shadow_type, n)				\
+	((offsetof(type, shadow) + (n) * sizeof(shadow_type)		\
+	  + __alignof__(type) - 1) & ~(__alignof__(type) - 1))
+
+/* a pool chunk holds as many structs with `nr_shadow` shadows as `size`
+ * does with MEMPOOL_SHADOWS */
+static size_t shadowed_pool_size(size_t size, int nr_shadow)
+{
+	if (nr_shadow <= MEMPOOL_SHADOWS)
+		return size;
+	return size / MEMPOOL_SHADOWS * nr_shadow;
+}
+
+void plan_init(struct plan *plan, int nr_shadow, const int *shadow_node,
+	       struct numa *numa)
 {
 	plan->op_rank = btree_mem_new(sizeof(struct refcnt_operator_key), 1,
 				      refcnt_operator_compare);
@@ -124,20 +163,82 @@ void plan_init(struct plan *plan)
 	//  				 256 << 20,
 	//  				 word_hash,
 	//  				 word_compare);
+	optrie_init(&plan->op_trie);
+	plan->delete_index = hashtable_new(sizeof(word_t),
+					   sizeof(struct op_posting *),
+					   DELETE_INDEX_CAP, variant_hash,
+					   word_compare);
+	mempool_init(&plan->posting_pool, sizeof(struct op_posting),
+		     POSTING_POOL_SIZE);
+	mempool_set_name(&plan->posting_pool, "op-posting-pool");
+	list_init(&plan->delete_ops);
+	plan->nr_delete_ops = 0;
+	memset(plan->nr_delete_depth, 0, sizeof(plan->nr_delete_depth));
+	plan->segment_index = hashtable_new(sizeof(struct segment_key),
+					    sizeof(struct op_posting *),
+					    SEGMENT_INDEX_CAP, segment_hash,
+					    segment_compare);
+	list_init(&plan->segment_ops);
+	plan->nr_segment_ops = 0;
+	memset(plan->nr_segment_splits, 0, sizeof(plan->nr_segment_splits));
+	memo_init(&plan->memo, MEMO_SETS);
+	plan->dfa_bytes = 0;
+	plan->bloom_probes = 0;
+	plan->bloom_negatives = 0;
+	plan->bloom_false_pos = 0;
+	dict_init(&plan->dict);
+	list_init(&plan->neigh_ops);
 	int i = 0;
-	for (i = 0; i < NR_SHADOW; i++) {
-		mempool_init(&plan->shadow_mempool[i], BTREE_NODE_SIZE,
-			     SHADOW_MEMPOOL_SIZE);
-		plan->bitmap_mem[i] = malloc(SHADOW_BITMAP_NR_BITS >> 3);
-		bitmap_reset(plan->bitmap_mem[i], SHADOW_BITMAP_NR_BITS);
-	}
-	mempool_init(&plan->query_pool, sizeof(struct query_struct),
-		     QUERY_MEMPOOL_SIZE);
+	plan->nr_shadow = nr_shadow;
+	plan->dict_members = calloc(nr_shadow, sizeof(u8 *));
+	plan->shadow_mempool = calloc(nr_shadow, sizeof(struct mempool));
+	plan->bitmap_mem = calloc(nr_shadow, sizeof(u8 *));
+	plan->op_dist_mem = calloc(nr_shadow, sizeof(*plan->op_dist_mem));
+	plan->op_dist_cap = calloc(nr_shadow, sizeof(int));
+	plan->doc_words = calloc(nr_shadow * DOC_BATCH_MAX,
+				 sizeof(struct wordset));
+	plan->doc_arena = calloc(nr_shadow, sizeof(struct arena));
+	plan->shadow_node = calloc(nr_shadow, sizeof(int));
+	if (shadow_node != NULL)
+		memcpy(plan->shadow_node, shadow_node, nr_shadow * sizeof(int));
+	plan->numa = numa;
+	plan->nr_replicas = numa != NULL ? numa->nr_nodes : 0;
+	plan->replicas = calloc(plan->nr_replicas, sizeof(struct plan_replica));
+	for (i = 0; i < plan->nr_replicas; i++)
+		arena_init(&plan->replicas[i].mem);
+	mempool_init(&plan->query_pool,
+		     SHADOWED_SIZE(struct query_struct, struct query_shadow,
+				   nr_shadow),
+		     shadowed_pool_size(QUERY_MEMPOOL_SIZE, nr_shadow));
 	mempool_set_name(&plan->query_pool, "query-pool");
-	mempool_init(&plan->op_pool, sizeof(struct operator),
-		     OP_MEMPOOL_SIZE);
+	mempool_init(&plan->op_pool,
+		     SHADOWED_SIZE(struct operator, struct operator_shadow,
+				   nr_shadow),
+		     shadowed_pool_size(OP_MEMPOOL_SIZE, nr_shadow));
 	mempool_set_name(&plan->op_pool, "operator-pool");
 	list_init(&plan->dirty_ops);
+
+	plan->batches = NULL;
+	plan->nr_batches = plan->batch_cap = 0;
+	for (i = 0; i <= MAX_WORD_LENGTH; i++)
+		list_init(&plan->partial_batches[i]);
+	/* the empty tree has no nodes yet, nothing to place */
+	for (i = 0; i < plan->nr_replicas; i++)
+		plan->replicas[i].op_rank = plan->op_rank;
+}
+
+void plan_init_shadow(struct plan *plan, int i)
+{
+	plan->dict_members[i] = calloc(DICT_MAX_WORDS >> 3, 1);
+	mempool_init(&plan->shadow_mempool[i], BTREE_NODE_SIZE,
+		     SHADOW_MEMPOOL_SIZE);
+	plan->bitmap_mem[i] = malloc(SHADOW_BITMAP_NR_BITS >> 3);
+	bitmap_reset(plan->bitmap_mem[i], SHADOW_BITMAP_NR_BITS);
+	plan->op_dist_mem[i] = NULL;
+	plan->op_dist_cap[i] = 0;
+	memset(plan_doc_words(plan, i, 0), 0,
+	       DOC_BATCH_MAX * sizeof(struct wordset));
+	arena_init(&plan->doc_arena[i]);
 }
 
 static void free_all_queries(struct plan *plan)
@@ -160,10 +261,37 @@ void plan_destroy(struct plan *plan)
 	btree_mem_destroy(plan->query_table);
 	hashtable_destroy(plan->query_dedup);
 	btree_mem_destroy(plan->word_index);
+	optrie_destroy(&plan->op_trie);
+	hashtable_destroy(plan->delete_index);
+	hashtable_destroy(plan->segment_index);
+	memo_destroy(&plan->memo);
+	dict_destroy(&plan->dict);
+	mempool_destroy(&plan->posting_pool);
 	int i = 0;
-	for (i = 0; i < NR_SHADOW; i++) {
+	for (i = 0; i < plan->nr_shadow; i++) {
 		mempool_destroy(&plan->shadow_mempool[i]);
+		free(plan->op_dist_mem[i]);
+		free(plan->dict_members[i]);
+		free(plan->bitmap_mem[i]);
+		arena_destroy(&plan->doc_arena[i]);
 	}
+	for (i = 0; i < plan->nr_shadow * DOC_BATCH_MAX; i++)
+		wordset_destroy(&plan->doc_words[i]);
+	free(plan->shadow_mempool);
+	free(plan->op_dist_mem);
+	free(plan->op_dist_cap);
+	free(plan->dict_members);
+	free(plan->bitmap_mem);
+	free(plan->doc_words);
+	free(plan->doc_arena);
+	for (i = 0; i < plan->nr_replicas; i++)
+		arena_destroy(&plan->replicas[i].mem);
+	free(plan->replicas);
+	free(plan->shadow_node);
+	for (i = 0; i < plan->nr_batches; i++) {
+		free(plan->batches[i]);
+	}
+	free(plan->batches);
 	mempool_destroy(&plan->query_pool);
 	mempool_destroy(&plan->op_pool);
 }
@@ -190,8 +318,22 @@ static struct operator* operator_new(struct plan *plan, word_t word, int len)
 {
 	struct operator *op = mempool_alloc(&plan->op_pool);
 	int i = 0, j = 0;
+	if (op == NULL)
+		return NULL;
 	memcpy(op->word, word, sizeof(word_t));
 	op->len = len;
+	op->hash = memo_word_hash(op->word);
+	CharSigInit(&op->sig, word, len);
+	BitPatternInit(&op->pattern, word, len);
+	op->batch = NULL;
+	op->slot = -1;
+	op->dfa = NULL;
+	op->dfa_dropped = 0;
+	memset(&op->delete_head, 0, sizeof(struct list_head));
+	op->delete_depth = 0;
+	memset(&op->segment_head, 0, sizeof(struct list_head));
+	op->segment_k = 0;
+	op->neigh = NULL;
 	op->refcnt = 0;
 	memset(&op->dirty_head, 0, sizeof(struct list_head));
 
@@ -202,23 +344,436 @@ static struct operator* operator_new(struct plan *plan, word_t word, int len)
 		}
 	}
 	/* set the shadows as uninitialized */
-	for (i = 0; i < NR_SHADOW; i++) {
+	for (i = 0; i < plan->nr_shadow; i++) {
 		op->shadow[i].refcnt = -1;
 	}
 	return op;
 }
 
+static struct op_batch *op_batch_new(struct plan *plan, int len)
+{
+	struct op_batch *batch = NULL;
+
+	if (posix_memalign((void **) &batch, 64, sizeof(struct op_batch)))
+		abort();
+	WordBatchInit(&batch->wb, len);
+	memset(batch->ops, 0, sizeof(batch->ops));
+	batch->nr_ops = 0;
+	if (plan->nr_batches == plan->batch_cap) {
+		plan->batch_cap = plan->batch_cap ? plan->batch_cap * 2 : 64;
+		plan->batches = realloc(plan->batches, plan->batch_cap
+					* sizeof(struct op_batch *));
+	}
+	batch->id = plan->nr_batches++;
+	plan->batches[batch->id] = batch;
+	list_add(&batch->head, &plan->partial_batches[len]);
+	return batch;
+}
+
+/* give a newly live operator a lane in a batch of its length */
+static void operator_attach_batch(struct plan *plan, struct operator *op)
+{
+	struct list_head *partial = &plan->partial_batches[op->len];
+	struct op_batch *batch = NULL;
+	int lane = 0;
+
+	if (list_empty(partial))
+		batch = op_batch_new(plan, op->len);
+	else
+		batch = container_of(partial->next, struct op_batch, head);
+	while (batch->ops[lane] != NULL)
+		lane++;
+	batch->ops[lane] = op;
+	WordBatchSetLane(&batch->wb, lane, op->word);
+	if (++batch->nr_ops == BATCH_LANES)
+		list_del(&batch->head);
+	op->batch = batch;
+	op->slot = batch->id * BATCH_LANES + lane;
+}
+
+/* empty batches stay on the partial list and are reused */
+static void operator_detach_batch(struct plan *plan, struct operator *op)
+{
+	struct op_batch *batch = op->batch;
+	int lane = op->slot % BATCH_LANES;
+
+	if (batch == NULL)
+		return;
+	if (batch->nr_ops-- == BATCH_LANES)
+		list_add(&batch->head, &plan->partial_batches[op->len]);
+	batch->ops[lane] = NULL;
+	WordBatchClearLane(&batch->wb, lane);
+	op->batch = NULL;
+	op->slot = -1;
+}
+
+static int operator_has_edit_refs(struct operator *op)
+{
+	int i = 0;
+	for (i = 1; i <= MAX_DIST; i++) {
+		if (op->nr_refs[MT_EDIT_DIST][i] != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * call `fn` on every variant of `word` with up to `depth` deletions. deleted
+ * positions only grow along a path, so each set of positions is visited
+ * once; a few variants still repeat when different sets give the same word.
+ */
+static void deletion_walk(const char *word, int len, int start, int depth,
+			  void (*fn)(word_t, int, void *), void *arg)
+{
+	word_t next;
+	int i = 0;
+
+	memcpy(next, word, sizeof(word_t));
+	fn(next, len, arg);
+	if (depth == 0)
+		return;
+	for (i = start; i < len; i++) {
+		memcpy(next, word, i);
+		memcpy(next + i, word + i + 1, len - i - 1);
+		memset(next + len - 1, 0, sizeof(word_t) - len + 1);
+		deletion_walk(next, len - 1, i, depth - 1, fn, arg);
+	}
+}
+
+struct delete_index_ctx {
+	struct plan *plan;
+	struct operator *op;
+	const char *word; /* probed doc word */
+	int len;
+	op_hit_cb hit;
+	void *arg;
+};
+
+static void delete_index_add_variant(word_t variant, int len, void *arg)
+{
+	struct delete_index_ctx *ctx = arg;
+	struct plan *plan = ctx->plan;
+	struct op_posting **head =
+		hashtable_search(plan->delete_index, variant);
+	struct op_posting *posting = NULL;
+
+	/* variants of one operator are added back to back, a repeated
+	 * variant finds the operator at the head of the list */
+	if (head != NULL && *head != NULL && (*head)->op == ctx->op)
+		return;
+	posting = mempool_alloc(&plan->posting_pool);
+	posting->op = ctx->op;
+	posting->next = head != NULL ? *head : NULL;
+	if (head != NULL)
+		*head = posting;
+	else
+		hashtable_insert(plan->delete_index, variant, &posting);
+}
+
+static void delete_index_del_variant(word_t variant, int len, void *arg)
+{
+	struct delete_index_ctx *ctx = arg;
+	struct plan *plan = ctx->plan;
+	struct op_posting **head =
+		hashtable_search(plan->delete_index, variant);
+	struct op_posting **link = head;
+
+	if (head == NULL)
+		return;
+	while (*link != NULL && (*link)->op != ctx->op)
+		link = &(*link)->next;
+	if (*link == NULL)
+		return;
+	{
+		struct op_posting *posting = *link;
+		*link = posting->next;
+		mempool_free(&plan->posting_pool, posting);
+	}
+	if (*head == NULL)
+		hashtable_delete(plan->delete_index, variant);
+}
+
+/**
+ * deletions to index `op` with: the largest edit threshold of its refs. an
+ * operator also asked for more than DELETE_INDEX_DEPTH is left out, the
+ * index could only bound it and its variants cost the most.
+ */
+static int operator_delete_depth(struct operator *op)
+{
+	int k = 0;
+
+	for (k = MAX_DIST; k > DELETE_INDEX_DEPTH; k--) {
+		if (op->nr_refs[MT_EDIT_DIST][k] != 0)
+			return 0;
+	}
+	for (; k > 0; k--) {
+		if (op->nr_refs[MT_EDIT_DIST][k] != 0)
+			return k;
+	}
+	return 0;
+}
+
+static void operator_index_deletions(struct plan *plan, struct operator *op,
+				     int depth)
+{
+	struct delete_index_ctx ctx = { plan, op };
+	deletion_walk(op->word, op->len, 0, depth, delete_index_add_variant,
+		      &ctx);
+	op->delete_depth = depth;
+	list_add(&op->delete_head, &plan->delete_ops);
+	plan->nr_delete_ops++;
+	plan->nr_delete_depth[depth]++;
+}
+
+static void operator_unindex_deletions(struct plan *plan, struct operator *op)
+{
+	struct delete_index_ctx ctx = { plan, op };
+	if (op->delete_depth == 0)
+		return;
+	deletion_walk(op->word, op->len, 0, op->delete_depth,
+		      delete_index_del_variant, &ctx);
+	list_del(&op->delete_head);
+	memset(&op->delete_head, 0, sizeof(struct list_head));
+	plan->nr_delete_ops--;
+	plan->nr_delete_depth[op->delete_depth]--;
+	op->delete_depth = 0;
+}
+
+static void delete_index_probe_variant(word_t variant, int len, void *arg)
+{
+	struct delete_index_ctx *ctx = arg;
+	struct op_posting **head =
+		hashtable_search(ctx->plan->delete_index, variant);
+	struct op_posting *posting = NULL;
+
+	if (head == NULL)
+		return;
+	for (posting = *head; posting != NULL; posting = posting->next) {
+		struct operator *op = posting->op;
+		int dist = 0;
+		if (op->len - ctx->len > op->delete_depth
+		    || ctx->len - op->len > op->delete_depth)
+			continue;
+		/* a shared variant only means dist <= 2 * depth, verify */
+		dist = EditDistanceBitParallel(&op->pattern, ctx->word,
+					       ctx->len,
+					       op->delete_depth + 1);
+		if (dist <= op->delete_depth)
+			ctx->hit(op, dist, ctx->arg);
+	}
+}
+
+void plan_probe_deletions(struct plan *plan, const char *word, int len,
+			  op_hit_cb hit, void *arg)
+{
+	struct delete_index_ctx ctx = { plan, NULL, word, len, hit, arg };
+	int depth = DELETE_INDEX_DEPTH;
+
+	/* as deep as the deepest operator, a word within k of an operator
+	 * shares a variant of at most k deletions with it */
+	while (depth > 0 && plan->nr_delete_depth[depth] == 0)
+		depth--;
+	deletion_walk(word, len, 0, depth, delete_index_probe_variant, &ctx);
+}
+
+static void segment_key_init(struct segment_key *key, const char *word,
+			     int len, int k, int pos)
+{
+	int start = pos * len / (k + 1);
+	int end = (pos + 1) * len / (k + 1);
+
+	memset(key, 0, sizeof(struct segment_key));
+	key->len = len;
+	key->k = k;
+	key->pos = pos;
+	memcpy(key->seg, word + start, end - start);
+}
+
+/**
+ * the largest hamming distance anyone asks of this operator: edit refs
+ * use the hamming distance as a bound up to MAX_DIST.
+ */
+static int operator_hamming_k(struct operator *op)
+{
+	int k = 0;
+
+	if (operator_has_edit_refs(op))
+		return MAX_DIST;
+	for (k = MAX_DIST; k > 0; k--) {
+		if (op->nr_refs[MT_HAMMING_DIST][k] != 0)
+			return k;
+	}
+	return 0;
+}
+
+static void operator_index_segments(struct plan *plan, struct operator *op,
+				    int k)
+{
+	struct segment_key key;
+	int pos = 0;
+
+	for (pos = 0; pos <= k; pos++) {
+		struct op_posting **head = NULL;
+		struct op_posting *posting = mempool_alloc(&plan->posting_pool);
+		segment_key_init(&key, op->word, op->len, k, pos);
+		head = hashtable_search(plan->segment_index, &key);
+		posting->op = op;
+		posting->next = head != NULL ? *head : NULL;
+		if (head != NULL)
+			*head = posting;
+		else
+			hashtable_insert(plan->segment_index, &key, &posting);
+	}
+	op->segment_k = k;
+	list_add(&op->segment_head, &plan->segment_ops);
+	plan->nr_segment_ops++;
+	plan->nr_segment_splits[op->len][k]++;
+}
+
+static void operator_unindex_segments(struct plan *plan, struct operator *op)
+{
+	struct segment_key key;
+	int k = op->segment_k;
+	int pos = 0;
+
+	if (k == 0)
+		return;
+	for (pos = 0; pos <= k; pos++) {
+		struct op_posting **head = NULL;
+		struct op_posting **link = NULL;
+		segment_key_init(&key, op->word, op->len, k, pos);
+		head = hashtable_search(plan->segment_index, &key);
+		for (link = head; *link != NULL; link = &(*link)->next) {
+			if ((*link)->op == op) {
+				struct op_posting *posting = *link;
+				*link = posting->next;
+				mempool_free(&plan->posting_pool, posting);
+				break;
+			}
+		}
+		if (*head == NULL)
+			hashtable_delete(plan->segment_index, &key);
+	}
+	op->segment_k = 0;
+	list_del(&op->segment_head);
+	memset(&op->segment_head, 0, sizeof(struct list_head));
+	plan->nr_segment_ops--;
+	plan->nr_segment_splits[op->len][k]--;
+}
+
+void plan_probe_segments(struct plan *plan, const char *word, int len,
+			 op_hit_cb hit, void *arg)
+{
+	struct segment_key key;
+	int k = 0, pos = 0;
+
+	for (k = 1; k <= MAX_DIST; k++) {
+		if (plan->nr_segment_splits[len][k] == 0)
+			continue;
+		for (pos = 0; pos <= k; pos++) {
+			struct op_posting **head = NULL;
+			struct op_posting *posting = NULL;
+			segment_key_init(&key, word, len, k, pos);
+			head = hashtable_search(plan->segment_index, &key);
+			if (head == NULL)
+				continue;
+			for (posting = *head; posting; posting = posting->next) {
+				int dist = HammingDistance(posting->op->word,
+							   len, word, len, 0);
+				if (dist <= k)
+					hit(posting->op, dist, arg);
+			}
+		}
+	}
+}
+
+static void operator_neigh_new(struct plan *plan, struct operator *op)
+{
+	op->neigh = calloc(1, sizeof(struct op_neigh));
+	op->neigh->len = op->len;
+	list_add(&op->neigh->head, &plan->neigh_ops);
+}
+
+void plan_dict_evict(struct plan *plan)
+{
+	u32 *remap = malloc(sizeof(u32) * (plan->dict.nr_words + 1));
+	u32 *ranks[MAX_WORD_LENGTH + 1];
+	struct list_head *entry = NULL;
+	int i = 0, j = 0;
+
+	dict_evict(&plan->dict, remap, ranks);
+	for (entry = plan->neigh_ops.next; entry != &plan->neigh_ops;
+	     entry = entry->next) {
+		struct op_neigh *neigh =
+			container_of(entry, struct op_neigh, head);
+		int num = 0;
+		for (i = 0; i < neigh->num; i++) {
+			u32 id = remap[neigh->ents[i].id];
+			if (id == DICT_NO_ID)
+				continue;
+			neigh->ents[num] = neigh->ents[i];
+			neigh->ents[num++].id = id;
+		}
+		neigh->num = num;
+		for (j = 0; j <= 2 * MAX_DIST; j++) {
+			int len = neigh->len - MAX_DIST + j;
+			if (len < MIN_WORD_LENGTH || len > MAX_WORD_LENGTH)
+				continue;
+			neigh->watermarks[j] = ranks[len][neigh->watermarks[j]];
+		}
+	}
+	for (i = 0; i <= MAX_WORD_LENGTH; i++)
+		free(ranks[i]);
+	free(remap);
+}
+
+/**
+ * the levenshtein automaton of `op`, NULL when it cannot have one. it is
+ * built by the first worker asking for it, so the submitter never pays for
+ * it; workers racing for it keep the first one published.
+ */
+struct lev_automaton *operator_dfa(struct plan *plan, struct operator *op)
+{
+	struct lev_automaton *dfa = op->dfa;
+
+	if (dfa != NULL || op->dfa_dropped
+	    || plan->dfa_bytes >= LEV_DFA_BUDGET)
+		return dfa;
+	dfa = lev_automaton_new(op->word, op->len, MAX_DIST);
+	if (dfa == NULL) {
+		op->dfa_dropped = 1;
+		return NULL;
+	}
+	if (!__sync_bool_compare_and_swap(&op->dfa, NULL, dfa)) {
+		lev_automaton_destroy(dfa);
+		return op->dfa;
+	}
+	__sync_fetch_and_add(&plan->dfa_bytes, lev_automaton_size(dfa));
+	return dfa;
+}
+
 static void operator_destroy(struct plan *plan, struct operator *op)
 {
 	int i = 0;
-	for (i = 0; i < NR_SHADOW; i++) {
+	for (i = 0; i < plan->nr_shadow; i++) {
 		assert(op->shadow[i].refcnt == -1);
 	}
+	if (op->dfa != NULL) {
+		__sync_fetch_and_sub(&plan->dfa_bytes,
+				     lev_automaton_size(op->dfa));
+		lev_automaton_destroy(op->dfa);
+	}
+	if (op->neigh != NULL) {
+		list_del(&op->neigh->head);
+		free(op->neigh->ents);
+		free(op->neigh);
+	}
 	mempool_free(&plan->op_pool, op);
 }
 
-void plan_add_query(struct plan *plan, unsigned int qid, const char *str,
-		    MatchType mt, unsigned int threshold)
+/* returns 0 if the pools are exhausted, nothing of the query is kept */
+int plan_add_query(struct plan *plan, unsigned int qid, const char *str,
+		   MatchType mt, unsigned int threshold)
 {
 	int idx = 0;
 	int i = 0;
@@ -229,9 +784,13 @@ void plan_add_query(struct plan *plan, unsigned int qid, const char *str,
 	struct operator *op = NULL;
 	struct operator **val = NULL;
 	struct query_struct* qstruct = mempool_alloc(&plan->query_pool);
+	struct operator *fresh[MAX_QUERY_WORDS + 1];
+	int nr_fresh = 0;
 	u8 dummy = 0;
 	int dedup_flag = 1;
 
+	if (qstruct == NULL)
+		return 0;
 	if (threshold == 0) mt = MT_EXACT_MATCH;
 
 	qstruct->qid = qid;
@@ -239,7 +798,7 @@ void plan_add_query(struct plan *plan, unsigned int qid, const char *str,
 	qstruct->threshold = threshold;
 	qstruct->ops_len = 0;
 
-	for (i = 0; i < NR_SHADOW; i++) {
+	for (i = 0; i < plan->nr_shadow; i++) {
 		qstruct->shadow[i].active = 0;
 		list_init(&qstruct->shadow[i].head);
 	}
@@ -259,7 +818,11 @@ void plan_add_query(struct plan *plan, unsigned int qid, const char *str,
 		val = btree_search(plan->word_index, words[i]);
 		if (val == NULL) {
 			op = operator_new(plan, words[i], len[i]);
+			if (op == NULL)
+				goto undo;
+			fresh[nr_fresh++] = op;
 			btree_insert(plan->word_index, words[i], &op);
+			optrie_insert(&plan->op_trie, words[i], len[i], op);
 			dedup_flag = 0;
 		} else {
 			op = *val;
@@ -321,10 +884,19 @@ nodup:
 	btree_insert(plan->query_table, &qid, &qstruct);
 	// printf("inserting unique query %u %p\n", qstruct->qid, qstruct);
 	hashtable_insert(plan->query_dedup, &qstruct, &qstruct);
-	return;
+	return 1;
 free:
 	mempool_free(&plan->query_pool, qstruct);
-	return;
+	return 1;
+undo:
+	for (i = 0; i < nr_fresh; i++) {
+		btree_delete(plan->word_index, fresh[i]->word);
+		optrie_remove(&plan->op_trie, fresh[i]->word, fresh[i]->len);
+		optrie_compact(&plan->op_trie, fresh[i]->word, fresh[i]->len);
+		operator_destroy(plan, fresh[i]);
+	}
+	mempool_free(&plan->query_pool, qstruct);
+	return 0;
 }
 
 void plan_del_query(struct plan *plan, unsigned int qid)
@@ -376,6 +948,7 @@ void plan_del_query(struct plan *plan, unsigned int qid)
 		op->refcnt--;
 		if (op->refcnt == 0) {
 			btree_delete(plan->word_index, op->word);
+			optrie_remove(&plan->op_trie, op->word, op->len);
 		} else {
 			// printf("remove %p from %s %p level %d thre %d tree %p\n",
 			//        qstruct, op->word, op, qstruct->mt,
@@ -392,6 +965,33 @@ void plan_del_query(struct plan *plan, unsigned int qid)
 	mempool_free(&plan->query_pool, qstruct);
 }
 
+/**
+ * copy op_rank and the batches into each node's replica. the copies are
+ * made from a cpu of the node, so the pages they first touch are local.
+ */
+static void plan_refresh_replicas(struct plan *plan)
+{
+	int node = 0, i = 0;
+
+	for (node = 0; node < plan->nr_replicas; node++) {
+		struct plan_replica *replica = &plan->replicas[node];
+		numa_run_on(plan->numa, node);
+		arena_reset(&replica->mem);
+		replica->op_rank = btree_mem_replicate(plan->op_rank,
+						       &replica->mem);
+		replica->batches = arena_alloc(&replica->mem,
+					       sizeof(struct op_batch *)
+					       * (plan->nr_batches + 1), 64);
+		for (i = 0; i < plan->nr_batches; i++) {
+			replica->batches[i] = arena_alloc(
+				&replica->mem, sizeof(struct op_batch), 64);
+			memcpy(replica->batches[i], plan->batches[i],
+			       sizeof(struct op_batch));
+		}
+	}
+	numa_run_on(plan->numa, -1);
+}
+
 void plan_rebuild(struct plan *plan)
 {
 	struct list_head *ent = plan->dirty_ops.next;
@@ -408,10 +1008,33 @@ void plan_rebuild(struct plan *plan)
 			refkey.operator = op;
 			refkey.refcnt = op->refcnt;
 			btree_insert(plan->op_rank, &refkey, &dummy);
+			if (op->batch == NULL)
+				operator_attach_batch(plan, op);
+			if (op->delete_depth != operator_delete_depth(op)) {
+				operator_unindex_deletions(plan, op);
+				if (operator_delete_depth(op) > 0)
+					operator_index_deletions(
+						plan, op,
+						operator_delete_depth(op));
+			}
+			if (WORD_DICT && op->neigh == NULL)
+				operator_neigh_new(plan, op);
+			if (op->segment_k != operator_hamming_k(op)) {
+				operator_unindex_segments(plan, op);
+				if (operator_hamming_k(op) > 0)
+					operator_index_segments(
+						plan, op, operator_hamming_k(op));
+			}
 		} else {
+			operator_detach_batch(plan, op);
+			optrie_compact(&plan->op_trie, op->word, op->len);
+			operator_unindex_deletions(plan, op);
+			operator_unindex_segments(plan, op);
 			operator_destroy(plan, op);
 		}
 	}
+	if (plan->nr_replicas > 0)
+		plan_refresh_replicas(plan);
 }
 
 void operator_create_shadow(struct operator *op, int idx)
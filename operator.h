@@ -8,9 +8,23 @@
 #include "btree.h"
 #include "hashtable.h"
 #include "mempool.h"
-
-/* number of threads */
+#include "util.h"
+#include "automaton.h"
+#include "optrie.h"
+#include "memo.h"
+#include "dict.h"
+#include "document.h"
+#include "numa.h"
+
+/* number of threads when neither IndexConfig nor MISAKA_WORKERS sets it
+ * and the online cpus cannot be counted, and the most we ever start */
 #define NR_SHADOW 12
+#define MAX_SHADOW 256
+
+/* documents a worker matches together in batch mode, a bit each in a u64,
+ * and how many it takes when neither IndexConfig nor MISAKA_BATCH says */
+#define DOC_BATCH_MAX 64
+#define DOC_BATCH_DEFAULT 1
 
 /* query table hashtable size */
 #define QUERY_TABLE_BUCKET (10 << 22)
@@ -30,6 +44,28 @@
 /* reserve space for operator mempool */
 #define OP_MEMPOOL_SIZE (10 << 22)
 
+/* the sizes above are for up to this many shadows, they grow with more */
+#define MEMPOOL_SHADOWS 12
+
+/* deletion neighbourhood index of the edit operators: an operator is indexed
+ * with every variant of up to k deletions, k the largest edit threshold it
+ * is asked for, and only if that is at most DELETE_INDEX_DEPTH; 0 disables
+ * it. memory grows quickly with the depth. */
+#define DELETE_INDEX_DEPTH 2
+#define DELETE_INDEX_CAP (1 << 20)
+#define POSTING_POOL_SIZE (1 << 24)
+/* probe the index only once the indexed operators outnumber the unique
+ * doc words by this factor, each probe walks ~len^2/2 variants */
+#define DELETE_INDEX_MIN_RATIO 16
+
+/* pigeonhole index of the hamming operators: an operator needing hamming
+ * distances up to k is split into k+1 segments, one of which must match
+ * any word within k exactly */
+#define SEGMENT_INDEX_CAP (1 << 20)
+/* probe the index only once this many operators are indexed */
+#define SEGMENT_INDEX_MIN_OPS 2048
+#define SEGMENT_KEY_LEN 21
+
 struct query_ref_head {
 	struct list_head head;
 	int pos; /* position of this ref head */
@@ -41,7 +77,6 @@ struct query_shadow {
 };
 
 struct query_struct {
-	struct query_shadow shadow[NR_SHADOW];
 	unsigned int qid;
 	struct btree *alias;
 	MatchType mt;
@@ -50,6 +85,7 @@ struct query_struct {
 	u8 ops_len;
 	struct operator *ops[MAX_QUERY_WORDS];
 	struct query_ref_head ref_heads[MAX_QUERY_WORDS];
+	struct query_shadow shadow[]; /* plan->nr_shadow of them */
 };
 
 struct operator_shadow {
@@ -66,21 +102,96 @@ struct operator_shadow {
 };
 
 struct operator {
-	struct operator_shadow shadow[NR_SHADOW];
 	int refcnt;
 	word_t word;
 	int len;
+	u64 hash; /* memo_word_hash() of the word */
+	struct bitpattern pattern; /* Peq masks for the edit distance kernel */
+	struct charsig sig; /* letter counts for the edit lower bound */
+	struct op_batch *batch; /* SIMD batch this operator is a lane of */
+	int slot; /* batch->id * BATCH_LANES + lane */
+	/* built by the first trie walk that needs it, see operator_dfa() */
+	struct lev_automaton *volatile dfa;
+	volatile int dfa_dropped; /* too many states, walk the DP rows */
+	struct list_head delete_head; /* on plan->delete_ops once indexed */
+	int delete_depth; /* deletions indexed, 0 if none */
+	struct list_head segment_head; /* on plan->segment_ops once indexed */
+	int segment_k; /* hamming bound of the segment index, 0 if none */
+	struct op_neigh *neigh; /* dictionary neighbourhood, WORD_DICT only */
 	struct list_head dirty_head; /* dirty list to avoid double insertion
 				      * on constructing query plan */
 	int nr_refs[3][4];
 	struct list_head query_refs[3][4]; /* references to querys */
+	struct operator_shadow shadow[]; /* plan->nr_shadow of them */
+};
+
+/**
+ * live operators of the same length, transposed into the lanes of a
+ * wordbatch so that a doc word is streamed once through all of them.
+ */
+struct op_batch {
+	struct wordbatch wb;
+	int id;
+	int nr_ops;
+	struct operator *ops[BATCH_LANES];
+	struct list_head head; /* on plan->partial_batches while not full */
+};
+
+/* a dictionary word within MAX_DIST edits of an operator */
+struct neigh_entry {
+	u32 id;
+	u8 dist[2]; /* hamming (MAX_DIST + 1 across lengths), edit */
+};
+
+/**
+ * dictionary words within MAX_DIST of an operator. the dictionary buckets
+ * of lengths len - MAX_DIST .. len + MAX_DIST have been scanned up to the
+ * watermarks; the rest is the backlog, scanned once the documents matched
+ * the slow way have paid for it in credit.
+ */
+struct op_neigh {
+	volatile int busy; /* try-lock, a worker finding it taken goes the
+			    * slow way rather than wait */
+	struct neigh_entry *ents;
+	int num;
+	int cap;
+	u32 watermarks[2 * MAX_DIST + 1];
+	int len; /* of the operator word */
+	long credit;
+	struct list_head head; /* on plan->neigh_ops */
 };
 
+/* one operator producing a deletion variant or a segment */
+struct op_posting {
+	struct operator *op;
+	struct op_posting *next;
+};
+
+/* segment `pos` of the (len, k) split of an operator word */
+struct segment_key {
+	u8 len;
+	u8 k;
+	u8 pos;
+	char seg[SEGMENT_KEY_LEN];
+};
+
+typedef void (*op_hit_cb)(struct operator *op, int dist, void *arg);
+
 struct refcnt_operator_key {
 	int refcnt;
 	struct operator *operator;
 };
 
+/**
+ * read mostly copy of the hot plan structures on one numa node, refreshed
+ * by plan_rebuild(). the batches point at the same operators.
+ */
+struct plan_replica {
+	struct arena mem; /* first touched on the node */
+	struct btree *op_rank;
+	struct op_batch **batches;
+};
+
 /* query plan index */
 struct plan {
 	/* global op_rank and query_mask tree. they're just mem-tree, no cow */
@@ -93,22 +204,75 @@ struct plan {
 
 	/* mem-tree, `word->struct operator` */
 	struct btree *word_index;
+	/* trie of the live operator words, for doc-word-driven matching */
+	struct optrie op_trie;
+	/* deletion variant -> list of delete_posting */
+	struct hashtable *delete_index;
+	struct mempool posting_pool;
+	struct list_head delete_ops;
+	int nr_delete_ops;
+	int nr_delete_depth[DELETE_INDEX_DEPTH + 1]; /* operators per depth */
+	/* segment_key -> list of op_posting */
+	struct hashtable *segment_index;
+	struct list_head segment_ops;
+	int nr_segment_ops;
+	int nr_segment_splits[MAX_WORD_LENGTH + 1][MAX_DIST + 1];
+	/* (operator, doc word) distances kept across documents */
+	struct memo_cache memo;
+	/* bytes of all operator automata, see LEV_DFA_BUDGET */
+	volatile long dfa_bytes;
+	/* exact match lookups and how the document bloom filters did */
+	volatile unsigned long bloom_probes;
+	volatile unsigned long bloom_negatives;
+	volatile unsigned long bloom_false_pos;
+	/* doc word dictionary, and the operators holding a neighbourhood */
+	struct word_dict dict;
+	struct list_head neigh_ops;
+	/* dictionary ids of the document being matched, per shadow */
+	u8 **dict_members;
 	/* some stat counter */
 	unsigned long tot_words;
 
+	/* SIMD batches of operators, indexed by id / length */
+	struct op_batch **batches;
+	int nr_batches;
+	int batch_cap;
+	struct list_head partial_batches[MAX_WORD_LENGTH + 1];
+
+	/* one shadow per worker, the arrays below have nr_shadow entries */
+	int nr_shadow;
 	/* mempools for shadows */
-	struct mempool shadow_mempool[NR_SHADOW];
-	u8 *bitmap_mem[NR_SHADOW];
+	struct mempool *shadow_mempool;
+	u8 **bitmap_mem;
+	/* per document min distance of each operator slot */
+	u8 (**op_dist_mem)[2];
+	int *op_dist_cap;
+	/* word sets of the documents each worker is matching, DOC_BATCH_MAX
+	 * per shadow, see plan_doc_words() */
+	struct wordset *doc_words;
+	/* per document scratch memory of each worker */
+	struct arena *doc_arena;
+	/* numa node of each shadow, and a replica per node if any */
+	int *shadow_node;
+	struct numa *numa;
+	struct plan_replica *replicas;
+	int nr_replicas;
 	struct list_head dirty_ops;
 };
 
-void plan_init(struct plan *plan);
+/* `shadow_node` may be NULL for all on node 0, replicas are kept when
+ * `numa` is given */
+void plan_init(struct plan *plan, int nr_shadow, const int *shadow_node,
+	       struct numa *numa);
+/* called by the worker of the shadow, so its memory is node local */
+void plan_init_shadow(struct plan *plan, int shadow_id);
 void plan_destroy(struct plan *plan);
 /* plan is a singleton */
 struct plan *plan_get();
 
 void operator_create_shadow(struct operator *op, int idx);
 void operator_destroy_shadow(struct operator *op, int idx);
+struct lev_automaton *operator_dfa(struct plan *plan, struct operator *op);
 
 static inline int operator_shadow_is_zombie(struct operator_shadow *shadow)
 {
@@ -116,6 +280,19 @@ static inline int operator_shadow_is_zombie(struct operator_shadow *shadow)
 		 && shadow->zombie_list.next == &shadow->zombie_list);
 }
 
+/* the operator / query a shadow belongs to, `idx` is the shadow's index */
+static inline
+struct operator *operator_of_shadow(struct operator_shadow *shadow, int idx)
+{
+	return container_of(shadow - idx, struct operator, shadow[0]);
+}
+
+static inline
+struct query_struct *query_of_shadow(struct query_shadow *shadow, int idx)
+{
+	return container_of(shadow - idx, struct query_struct, shadow[0]);
+}
+
 static inline int operator_is_shadow_active(struct operator *op, int idx)
 {
 	return op->shadow[idx].refcnt != -1;
@@ -165,11 +342,53 @@ static inline struct query_shadow *query_shadow(struct query_struct *q, int idx)
 	return &q->shadow[idx];
 }
 
-void plan_add_query(struct plan *plan, unsigned int qid, const char *str,
+int  plan_add_query(struct plan *plan, unsigned int qid, const char *str,
 		    MatchType mt, unsigned int threshold);
 void plan_del_query(struct plan *plan, unsigned int qid);
 void plan_rebuild(struct plan *plan);
 
+static inline struct wordset *plan_doc_words(struct plan *plan,
+					     int shadow_id, int idx)
+{
+	return &plan->doc_words[shadow_id * DOC_BATCH_MAX + idx];
+}
+
+/* what a shadow reads op_rank and the batches from */
+static inline struct btree *plan_op_rank(struct plan *plan, int shadow_id)
+{
+	if (plan->nr_replicas == 0)
+		return plan->op_rank;
+	return plan->replicas[plan->shadow_node[shadow_id]].op_rank;
+}
+
+static inline struct op_batch **plan_batches(struct plan *plan,
+					     int shadow_id)
+{
+	if (plan->nr_replicas == 0)
+		return plan->batches;
+	return plan->replicas[plan->shadow_node[shadow_id]].batches;
+}
+
+/**
+ * evict the cold words of the dictionary and renumber the neighbourhoods,
+ * no document may be in flight.
+ */
+void plan_dict_evict(struct plan *plan);
+
+/**
+ * report every indexed operator within its delete_depth edits of `word`,
+ * with its exact distance.
+ */
+void plan_probe_deletions(struct plan *plan, const char *word, int len,
+			  op_hit_cb hit, void *arg);
+
+/**
+ * report every operator in the segment index within its segment_k hamming
+ * distance of `word`, with that distance.
+ */
+void plan_probe_segments(struct plan *plan, const char *word, int len,
+			 op_hit_cb hit, void *arg);
+
 /* misc compare functions */
 int uint_compare(const void *p, const void *q);
 int ptr_compare(const void *p, const void *q);
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optrie.h"
+
+#define OPTRIE_INIT_CAP 1024
+
+void optrie_init(struct optrie *trie)
+{
+	trie->cap = OPTRIE_INIT_CAP;
+	trie->nodes = malloc(sizeof(struct optrie_node) * trie->cap);
+	memset(&trie->nodes[0], 0, sizeof(struct optrie_node));
+	trie->nr_nodes = 1;
+	trie->free_list = 0;
+}
+
+void optrie_destroy(struct optrie *trie)
+{
+	free(trie->nodes);
+	trie->nodes = NULL;
+	trie->nr_nodes = trie->cap = 0;
+}
+
+static u32 optrie_node_new(struct optrie *trie, char ch)
+{
+	u32 idx = trie->free_list;
+	if (idx != 0) {
+		trie->free_list = trie->nodes[idx].sibling;
+	} else {
+		if (trie->nr_nodes == trie->cap) {
+			trie->cap *= 2;
+			trie->nodes = realloc(trie->nodes,
+					      sizeof(struct optrie_node)
+					      * trie->cap);
+		}
+		idx = trie->nr_nodes++;
+	}
+	memset(&trie->nodes[idx], 0, sizeof(struct optrie_node));
+	trie->nodes[idx].ch = ch;
+	return idx;
+}
+
+static u32 optrie_find_child(struct optrie *trie, u32 parent, char ch)
+{
+	u32 idx = trie->nodes[parent].child;
+	while (idx != 0 && trie->nodes[idx].ch != ch)
+		idx = trie->nodes[idx].sibling;
+	return idx;
+}
+
+void optrie_insert(struct optrie *trie, const char *word, int len,
+		   void *value)
+{
+	u32 path[MAX_WORD_LENGTH + 1];
+	u32 idx = 0;
+	int i = 0;
+
+	path[0] = 0;
+	for (i = 0; i < len; i++) {
+		u32 next = optrie_find_child(trie, idx, word[i]);
+		if (next == 0) {
+			/* may move trie->nodes, so link it afterwards */
+			next = optrie_node_new(trie, word[i]);
+			trie->nodes[next].sibling = trie->nodes[idx].child;
+			trie->nodes[idx].child = next;
+		}
+		idx = next;
+		path[i + 1] = idx;
+	}
+	if (trie->nodes[idx].value != NULL) {
+		trie->nodes[idx].value = value;
+		return;
+	}
+	trie->nodes[idx].value = value;
+	for (i = 0; i <= len; i++)
+		trie->nodes[path[i]].nr_values++;
+}
+
+void optrie_remove(struct optrie *trie, const char *word, int len)
+{
+	u32 path[MAX_WORD_LENGTH + 1];
+	u32 idx = 0;
+	int i = 0;
+
+	path[0] = 0;
+	for (i = 0; i < len; i++) {
+		idx = optrie_find_child(trie, idx, word[i]);
+		if (idx == 0)
+			return;
+		path[i + 1] = idx;
+	}
+	if (trie->nodes[idx].value == NULL)
+		return;
+	trie->nodes[idx].value = NULL;
+	for (i = 0; i <= len; i++)
+		trie->nodes[path[i]].nr_values--;
+}
+
+static void optrie_free_subtree(struct optrie *trie, u32 idx)
+{
+	u32 child = trie->nodes[idx].child;
+	while (child != 0) {
+		u32 next = trie->nodes[child].sibling;
+		optrie_free_subtree(trie, child);
+		child = next;
+	}
+	trie->nodes[idx].sibling = trie->free_list;
+	trie->free_list = idx;
+}
+
+/* unlink the highest empty branch left behind on the path of `word` */
+void optrie_compact(struct optrie *trie, const char *word, int len)
+{
+	u32 parent = 0;
+	int i = 0;
+
+	for (i = 0; i < len; i++) {
+		u32 idx = optrie_find_child(trie, parent, word[i]);
+		u32 *link = NULL;
+		if (idx == 0)
+			return;
+		if (trie->nodes[idx].nr_values != 0) {
+			parent = idx;
+			continue;
+		}
+		link = &trie->nodes[parent].child;
+		while (*link != idx)
+			link = &trie->nodes[*link].sibling;
+		*link = trie->nodes[idx].sibling;
+		optrie_free_subtree(trie, idx);
+		return;
+	}
+}
+
+struct optrie_walk {
+	struct optrie *trie;
+	const char *word;
+	int len;
+	int max_dist;
+	optrie_hit_cb hit;
+	void *arg;
+	/* rows[d][j]: edit distance between the trie prefix of depth d and
+	 * the first j letters of word */
+	u8 rows[MAX_WORD_LENGTH + MAX_DIST + 2][MAX_WORD_LENGTH + 1];
+};
+
+static void optrie_walk_node(struct optrie_walk *walk, u32 idx, int depth,
+			     int hamming)
+{
+	struct optrie_node *node = &walk->trie->nodes[idx];
+	u8 *prev = walk->rows[depth - 1];
+	u8 *row = walk->rows[depth];
+	int n = walk->len;
+	int row_min = depth;
+	int j = 0;
+	u32 child = 0;
+
+	row[0] = depth;
+	for (j = 1; j <= n; j++) {
+		int v = prev[j] + 1;
+		int sub = prev[j - 1] + (walk->word[j - 1] != node->ch);
+		if (row[j - 1] + 1 < v)
+			v = row[j - 1] + 1;
+		if (sub < v)
+			v = sub;
+		row[j] = v;
+		if (v < row_min)
+			row_min = v;
+	}
+	/* no word below this prefix can get within max_dist */
+	if (row_min > walk->max_dist)
+		return;
+	if (depth <= n)
+		hamming += walk->word[depth - 1] != node->ch;
+	else
+		hamming = walk->max_dist + 1;
+
+	if (node->value != NULL && row[n] <= walk->max_dist) {
+		int ham = (depth == n && hamming <= walk->max_dist) ?
+			hamming : walk->max_dist + 1;
+		walk->hit(node->value, ham, row[n], walk->arg);
+	}
+	if (depth == n + walk->max_dist)
+		return;
+	for (child = node->child; child != 0;
+	     child = walk->trie->nodes[child].sibling) {
+		if (walk->trie->nodes[child].nr_values != 0)
+			optrie_walk_node(walk, child, depth + 1, hamming);
+	}
+}
+
+void optrie_match(struct optrie *trie, const char *word, int len,
+		  int max_dist, optrie_hit_cb hit, void *arg)
+{
+	struct optrie_walk walk;
+	u32 child = 0;
+	int j = 0;
+
+	walk.trie = trie;
+	walk.word = word;
+	walk.len = len;
+	walk.max_dist = max_dist;
+	walk.hit = hit;
+	walk.arg = arg;
+	for (j = 0; j <= len; j++)
+		walk.rows[0][j] = j;
+	for (child = trie->nodes[0].child; child != 0;
+	     child = trie->nodes[child].sibling) {
+		if (trie->nodes[child].nr_values != 0)
+			optrie_walk_node(&walk, child, 1, 0);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef _OPTRIE_H_
+#define _OPTRIE_H_
+
+#include "misc.h"
+#include "core.h"
+
+/**
+ * trie over the operator vocabulary. nodes live in one growable array and
+ * are linked first-child/next-sibling, index 0 is the root. removal only
+ * clears the value; the dead branches are reclaimed by optrie_compact().
+ */
+struct optrie_node {
+	u32 child;
+	u32 sibling;
+	u32 nr_values; /* live values in this subtree */
+	char ch;
+	void *value;
+};
+
+struct optrie {
+	struct optrie_node *nodes;
+	u32 nr_nodes;
+	u32 cap;
+	u32 free_list; /* reclaimed nodes, chained through sibling */
+};
+
+/* called for every value within max_dist of the probed word */
+typedef void (*optrie_hit_cb)(void *value, int hamming, int edit, void *arg);
+
+void optrie_init(struct optrie *trie);
+void optrie_destroy(struct optrie *trie);
+void optrie_insert(struct optrie *trie, const char *word, int len,
+		   void *value);
+void optrie_remove(struct optrie *trie, const char *word, int len);
+void optrie_compact(struct optrie *trie, const char *word, int len);
+
+/**
+ * one pruned depth first traversal reporting every value whose word is
+ * within max_dist of `word`, by edit distance or by hamming distance. the
+ * distance that is not within max_dist is reported as max_dist + 1.
+ */
+void optrie_match(struct optrie *trie, const char *word, int len,
+		  int max_dist, optrie_hit_cb hit, void *arg);
+
+#endif /* _OPTRIE_H_ */
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+
+#include "../util.h"
+#include "../automaton.h"
+#include "../core.h"
+
+/* mismatches over all the tests, release builds drop assert() */
+static int errors;
+
+/* plain full DP, the reference for the fast kernels */
+static int full_edit_distance(const char *a, int na, const char *b, int nb)
+{
+	int T[MAX_WORD_LENGTH + 1][MAX_WORD_LENGTH + 1];
+	int i = 0, j = 0;
+	for (i = 0; i <= na; i++) T[i][0] = i;
+	for (j = 0; j <= nb; j++) T[0][j] = j;
+	for (i = 1; i <= na; i++) {
+		for (j = 1; j <= nb; j++) {
+			int ret = T[i - 1][j] + 1;
+			int d2 = T[i][j - 1] + 1;
+			int d3 = T[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+			if (d2 < ret) ret = d2;
+			if (d3 < ret) ret = d3;
+			T[i][j] = ret;
+		}
+	}
+	return T[na][nb];
+}
+
+/* small alphabet so that close words are common */
+static int random_word(word_t word)
+{
+	int len = MIN_WORD_LENGTH
+		+ rand() % (MAX_WORD_LENGTH - MIN_WORD_LENGTH + 1);
+	int i = 0;
+	memset(word, 0, sizeof(word_t));
+	for (i = 0; i < len; i++)
+		word[i] = 'a' + rand() % 4;
+	return len;
+}
+
+static int mutate_word(word_t dst, const word_t src, int len)
+{
+	int i = 0, n = rand() % (MAX_DIST + 2);
+	memcpy(dst, src, sizeof(word_t));
+	for (i = 0; i < n; i++) {
+		int pos = rand() % len;
+		switch (rand() % 3) {
+		case 0:
+			dst[pos] = 'a' + rand() % 4;
+			break;
+		case 1:
+			if (len < MAX_WORD_LENGTH) {
+				memmove(dst + pos + 1, dst + pos, len - pos);
+				dst[pos] = 'a' + rand() % 4;
+				len++;
+			}
+			break;
+		case 2:
+			if (len > MIN_WORD_LENGTH) {
+				memmove(dst + pos, dst + pos + 1, len - pos);
+				len--;
+			}
+			break;
+		}
+	}
+	dst[len] = 0;
+	return len;
+}
+
+#define EDIT_CNT 1000000
+
+static void test_edit_distance()
+{
+	struct bitpattern pat;
+	struct charsig sa, sb;
+	word_t a, b;
+	int i = 0, k = 0;
+
+	puts("testing bit-parallel edit distance");
+	for (i = 0; i < EDIT_CNT; i++) {
+		int na = random_word(a);
+		int nb = mutate_word(b, a, na);
+		int expect = full_edit_distance(a, na, b, nb);
+		BitPatternInit(&pat, a, na);
+		CharSigInit(&sa, a, na);
+		CharSigInit(&sb, b, nb);
+		if (CharSigBound(&sa, na, &sb, nb) > expect) {
+			fprintf(stderr, "signature %s %s: bound %d > %d\n",
+				a, b, CharSigBound(&sa, na, &sb, nb), expect);
+			errors++;
+		}
+		for (k = 1; k <= MAX_DIST + 1; k++) {
+			int dist = EditDistanceBitParallel(&pat, b, nb, k);
+			/* exact below the cutoff, MAX_DIST + 1 otherwise */
+			if ((expect < k && dist != expect)
+			    || (expect >= k && dist != MAX_DIST + 1)) {
+				fprintf(stderr, "edit %s %s k %d: %d != %d\n",
+					a, b, k, dist, expect);
+				errors++;
+			}
+		}
+	}
+}
+
+#define AUTOMATON_CNT 2000
+#define AUTOMATON_TEXTS 200
+
+static void test_automaton()
+{
+	struct lev_automaton *dfa = NULL;
+	word_t a, b;
+	int i = 0, j = 0, k = 0;
+	long states = 0;
+
+	puts("testing levenshtein automaton");
+	for (i = 0; i < AUTOMATON_CNT; i++) {
+		int na = random_word(a);
+		dfa = lev_automaton_new(a, na, MAX_DIST);
+		if (dfa == NULL)
+			continue;
+		states += dfa->nr_states;
+		for (j = 0; j < AUTOMATON_TEXTS; j++) {
+			int nb = mutate_word(b, a, na);
+			int expect = full_edit_distance(a, na, b, nb);
+			for (k = 1; k <= MAX_DIST + 1; k++) {
+				int dist = lev_automaton_distance(dfa, b, nb,
+								  k);
+				if ((expect < k && dist != expect)
+				    || (expect >= k && dist != MAX_DIST + 1)) {
+					fprintf(stderr,
+						"dfa %s %s k %d: %d != %d\n",
+						a, b, k, dist, expect);
+					errors++;
+				}
+			}
+		}
+		lev_automaton_destroy(dfa);
+	}
+	printf("average states %ld\n", states / AUTOMATON_CNT);
+}
+
+#define BLOCK_SIZE 67
+#define HAMMING_CNT 20000
+
+static void test_hamming_block()
+{
+	word_t *block = NULL;
+	word_t word;
+	int i = 0, j = 0;
+
+	puts("testing hamming block kernel");
+	if (posix_memalign((void **) &block, 64, sizeof(word_t) * BLOCK_SIZE))
+		abort();
+	for (i = 0; i < HAMMING_CNT; i++) {
+		int len = random_word(word);
+		int num = rand() % BLOCK_SIZE;
+		int expect = MAX_DIST + 1;
+		for (j = 0; j < num; j++) {
+			int dist = 0;
+			memcpy(block[j], word, sizeof(word_t));
+			block[j][rand() % len] = 'a' + rand() % 4;
+			block[j][rand() % len] = 'a' + rand() % 4;
+			block[j][rand() % len] = 'a' + rand() % 4;
+			dist = HammingDistance(block[j], len, word, len, 0);
+			if (dist < expect)
+				expect = dist;
+		}
+		j = HammingDistanceBlock(block, num, word, -1, MAX_DIST + 1);
+		if (j != expect) {
+			fprintf(stderr, "hamming %s: %d != %d\n", word, j,
+				expect);
+			errors++;
+		}
+	}
+	free(block);
+}
+
+#define BATCH_CNT 5000
+#define BATCH_WORDS 40
+
+/* random word of exactly `len` letters */
+static void random_word_of(word_t word, int len)
+{
+	int i = 0;
+	memset(word, 0, sizeof(word_t));
+	for (i = 0; i < len; i++)
+		word[i] = 'a' + rand() % 4;
+}
+
+static void test_batch()
+{
+	static word_t lanes[BATCH_LANES], words[BATCH_WORDS];
+	struct wordbatch batch;
+	u8 ham[BATCH_LANES], edit[BATCH_LANES];
+	int used[BATCH_LANES];
+	int i = 0, j = 0, lane = 0;
+
+	puts("testing batch kernels");
+	for (i = 0; i < BATCH_CNT; i++) {
+		int len = MIN_WORD_LENGTH
+			+ rand() % (MAX_WORD_LENGTH - MIN_WORD_LENGTH + 1);
+		int n = len + rand() % (2 * MAX_DIST + 1) - MAX_DIST;
+		int num = rand() % BATCH_WORDS;
+
+		if (n < MIN_WORD_LENGTH)
+			n = MIN_WORD_LENGTH;
+		if (n > MAX_WORD_LENGTH)
+			n = MAX_WORD_LENGTH;
+		/* a partial batch: lanes set once, some cleared again */
+		WordBatchInit(&batch, len);
+		for (lane = 0; lane < BATCH_LANES; lane++) {
+			used[lane] = rand() % 4 != 0;
+			random_word_of(lanes[lane], len);
+			if (used[lane] || rand() % 2)
+				WordBatchSetLane(&batch, lane, lanes[lane]);
+			if (!used[lane])
+				WordBatchClearLane(&batch, lane);
+			ham[lane] = edit[lane] = MAX_DIST + 1;
+		}
+		/* doc words near some lane, so the minimum moves */
+		for (j = 0; j < num; j++) {
+			memcpy(words[j], lanes[rand() % BATCH_LANES],
+			       sizeof(word_t));
+			words[j][rand() % len] = 'a' + rand() % 4;
+			/* cut or pad it to the doc word length */
+			for (lane = len; lane < n; lane++)
+				words[j][lane] = 'a' + rand() % 4;
+			memset(words[j] + n, 0, sizeof(word_t) - n);
+		}
+		if (n == len)
+			HammingDistanceBatch(&batch, words, num, ham);
+		EditDistanceBatch(&batch, words, num, n, edit);
+		for (lane = 0; lane < BATCH_LANES; lane++) {
+			int expect_ham = MAX_DIST + 1, expect_edit = MAX_DIST + 1;
+			if (!used[lane])
+				continue;
+			for (j = 0; j < num; j++) {
+				int dist = full_edit_distance(lanes[lane], len,
+							      words[j], n);
+				if (dist < expect_edit)
+					expect_edit = dist;
+				if (n != len)
+					continue;
+				dist = HammingDistance(lanes[lane], len,
+						       words[j], n, 0);
+				if (dist < expect_ham)
+					expect_ham = dist;
+			}
+			if (n == len && ham[lane] != expect_ham) {
+				fprintf(stderr, "hamming batch %s lane %d: "
+					"%d != %d\n", lanes[lane], lane,
+					ham[lane], expect_ham);
+				errors++;
+			}
+			if (edit[lane] != expect_edit) {
+				fprintf(stderr, "edit batch %s lane %d: "
+					"%d != %d\n", lanes[lane], lane,
+					edit[lane], expect_edit);
+				errors++;
+			}
+		}
+	}
+}
+
+#define TOKENIZE_CNT 2000
+#define TOKENIZE_LEN 700
+
+static void test_tokenize()
+{
+	static char doc[TOKENIZE_LEN];
+	static u32 offsets[TOKENIZE_LEN / 2 + 1];
+	static u8 lens[TOKENIZE_LEN / 2 + 1];
+	int i = 0, j = 0;
+
+	puts("testing tokenizer");
+	for (i = 0; i < TOKENIZE_CNT; i++) {
+		int len = rand() % TOKENIZE_LEN;
+		int num = 0, expect = 0;
+		/* mostly short runs of both, so words straddle the blocks */
+		for (j = 0; j < len; j++)
+			doc[j] = rand() % 3 ? 'a' + rand() % 26 : ' ';
+		num = Tokenize(doc, len, offsets, lens);
+		for (j = 0; j < len; j++) {
+			int start = j;
+			if (doc[j] == ' ')
+				continue;
+			while (j < len && doc[j] != ' ')
+				j++;
+			if (expect >= num || offsets[expect] != start
+			    || lens[expect] != j - start) {
+				fprintf(stderr, "token %d at %d\n", expect,
+					start);
+				errors++;
+				break;
+			}
+			expect++;
+		}
+		if (expect != num) {
+			fprintf(stderr, "%d tokens, expected %d\n", num,
+				expect);
+			errors++;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	srand(time(NULL));
+	test_edit_distance();
+	test_automaton();
+	test_hamming_block();
+	test_batch();
+	test_tokenize();
+	if (errors > 0)
+		fprintf(stderr, "%d errors\n", errors);
+	return errors != 0;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+
+#include "../core.h"
+
+#define NR_QUERIES 3000
+#define NR_DOCS 300
+#define DOC_WORDS 400
+#define SHORT_DOC_WORDS 20
+/* documents open at once, interleaved chunk by chunk */
+#define NR_OPEN 4
+/* whole documents checked against a brute force match as well */
+#define NR_CHECKED 8
+
+static char queries[NR_QUERIES][MAX_QUERY_LENGTH + 1];
+static MatchType types[NR_QUERIES];
+static int dists[NR_QUERIES];
+static char docs[NR_DOCS][DOC_WORDS * (MAX_WORD_LENGTH + 3)];
+static unsigned int nr_res[2 * NR_DOCS];
+static QueryID *res[2 * NR_DOCS];
+static int errors;
+
+/* not assert(), the calls must stay in a release build */
+static void expect(ErrorCode err, ErrorCode want, const char *call, int id)
+{
+	if (err != want) {
+		fprintf(stderr, "%s(%d) returned %d, not %d\n", call, id, err,
+			want);
+		errors++;
+	}
+}
+
+/* small alphabet so that queries match */
+static int random_word(char *word, int min, int max)
+{
+	int len = min + rand() % (max - min + 1);
+	int i = 0;
+	for (i = 0; i < len; i++)
+		word[i] = 'a' + rand() % 5;
+	word[len] = 0;
+	return len;
+}
+
+static void start_queries()
+{
+	char query[MAX_QUERY_LENGTH + 1];
+	int i = 0, j = 0;
+
+	for (i = 0; i < NR_QUERIES; i++) {
+		int nr_words = 1 + rand() % 2;
+		MatchType type = rand() % 3;
+		int pos = 0;
+		for (j = 0; j < nr_words; j++) {
+			if (j > 0)
+				query[pos++] = ' ';
+			pos += random_word(query + pos, MIN_WORD_LENGTH, 8);
+		}
+		query[pos] = 0;
+		strcpy(queries[i], query);
+		types[i] = type;
+		dists[i] = type == MT_EXACT_MATCH ? 0 : 1 + rand() % MAX_DIST;
+		StartQuery(i + 1, query, type, dists[i]);
+	}
+}
+
+/* plain DP, no cutoff */
+static int brute_edit(const char *a, int na, const char *b, int nb)
+{
+	int T[MAX_WORD_LENGTH + 1][MAX_WORD_LENGTH + 1];
+	int i = 0, j = 0;
+	for (i = 0; i <= na; i++) T[i][0] = i;
+	for (j = 0; j <= nb; j++) T[0][j] = j;
+	for (i = 1; i <= na; i++) {
+		for (j = 1; j <= nb; j++) {
+			int ret = T[i - 1][j] + 1;
+			int d2 = T[i][j - 1] + 1;
+			int d3 = T[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+			if (d2 < ret) ret = d2;
+			if (d3 < ret) ret = d3;
+			T[i][j] = ret;
+		}
+	}
+	return T[na][nb];
+}
+
+static int brute_word_match(const char *word, int len, const char *doc,
+			    MatchType type, int dist)
+{
+	while (*doc != 0) {
+		int n = 0, d = 0, i = 0;
+		while (*doc == ' ')
+			doc++;
+		while (doc[n] != ' ' && doc[n] != 0)
+			n++;
+		if (n == 0)
+			break;
+		if (type == MT_EDIT_DIST) {
+			d = brute_edit(word, len, doc, n);
+		} else if (n != len) {
+			d = dist + 1;
+		} else {
+			for (i = 0; i < len; i++)
+				d += word[i] != doc[i];
+		}
+		if (d <= dist)
+			return 1;
+		doc += n;
+	}
+	return 0;
+}
+
+/* the queries matching a document, word by word over the whole text */
+static void brute_match(int doc_id, const char *doc)
+{
+	unsigned int nr = 0;
+	int i = 0;
+
+	for (i = 0; i < NR_QUERIES; i++) {
+		const char *word = queries[i];
+		int ok = 1;
+		while (ok && *word != 0) {
+			int len = strcspn(word, " ");
+			ok = brute_word_match(word, len, doc, types[i],
+					      dists[i]);
+			word += len;
+			while (*word == ' ')
+				word++;
+		}
+		if (!ok)
+			continue;
+		if (nr >= nr_res[doc_id] || res[doc_id][nr] != i + 1) {
+			fprintf(stderr, "doc %d: query %d matches, result "
+				"%u of %u is %u\n", doc_id, i + 1, nr,
+				nr_res[doc_id],
+				nr < nr_res[doc_id] ? res[doc_id][nr] : 0);
+			errors++;
+			return;
+		}
+		nr++;
+	}
+	if (nr != nr_res[doc_id]) {
+		fprintf(stderr, "doc %d: %u results, %u match\n", doc_id,
+			nr_res[doc_id], nr);
+		errors++;
+	}
+}
+
+/**
+ * words of 4..12 letters, runs of one to three spaces around them. one in
+ * four is short, so that there are many more operators than words and the
+ * operators are matched in reverse
+ */
+static void random_doc(char *doc)
+{
+	int i = 0, pos = 0;
+	int nr_words = rand() % 4 ? DOC_WORDS : SHORT_DOC_WORDS;
+
+	for (i = 0; i < nr_words; i++) {
+		int spaces = i == 0 ? rand() % 2 : 1 + rand() % 3;
+		while (spaces-- > 0)
+			doc[pos++] = ' ';
+		pos += random_word(doc + pos, MIN_WORD_LENGTH, 12);
+	}
+	doc[pos] = 0;
+}
+
+/**
+ * the next chunk of a document: 1..7 bytes, so most words are split, and
+ * now and then a lone space
+ */
+static int next_chunk(const char *doc, int off, int len)
+{
+	int n = 1 + rand() % 7;
+	if (doc[off] == ' ' && rand() % 4 == 0)
+		return 1;
+	return n < len - off ? n : len - off;
+}
+
+static void match_docs()
+{
+	int offs[NR_OPEN], lens[NR_OPEN], ids[NR_OPEN];
+	int next = 0, nr_open = 0, i = 0;
+
+	/* odd ids are streamed, in between the whole even ones */
+	while (next < NR_DOCS || nr_open > 0) {
+		while (nr_open < NR_OPEN && next < NR_DOCS) {
+			random_doc(docs[next]);
+			expect(MatchDocument(2 * next, docs[next]),
+			       EC_SUCCESS, "MatchDocument", 2 * next);
+			expect(BeginDocument(2 * next + 1), EC_SUCCESS,
+			       "BeginDocument", 2 * next + 1);
+			offs[nr_open] = 0;
+			lens[nr_open] = strlen(docs[next]);
+			ids[nr_open++] = next++;
+		}
+		i = rand() % nr_open;
+		if (offs[i] < lens[i]) {
+			const char *doc = docs[ids[i]];
+			int n = next_chunk(doc, offs[i], lens[i]);
+			expect(AppendDocumentChunk(2 * ids[i] + 1,
+						   doc + offs[i], n),
+			       EC_SUCCESS, "AppendDocumentChunk",
+			       2 * ids[i] + 1);
+			offs[i] += n;
+			continue;
+		}
+		expect(EndDocument(2 * ids[i] + 1), EC_SUCCESS, "EndDocument",
+		       2 * ids[i] + 1);
+		expect(EndDocument(2 * ids[i] + 1), EC_FAIL, "EndDocument",
+		       2 * ids[i] + 1);
+		offs[i] = offs[nr_open - 1];
+		lens[i] = lens[nr_open - 1];
+		ids[i] = ids[--nr_open];
+	}
+}
+
+static void test_stream()
+{
+	DocID id = 0;
+	unsigned int nr = 0;
+	QueryID *qids = NULL;
+	int i = 0, matched = 0;
+
+	puts("testing streamed documents against MatchDocument");
+	start_queries();
+	match_docs();
+	for (i = 0; i < 2 * NR_DOCS; i++) {
+		if (GetNextAvailRes(&id, &nr, &qids) != EC_SUCCESS
+		    || id >= 2 * NR_DOCS || res[id] != NULL || nr_res[id] != 0) {
+			fprintf(stderr, "result %d: bad document %u\n", i, id);
+			errors++;
+			break;
+		}
+		nr_res[id] = nr;
+		res[id] = nr > 0 ? qids : NULL;
+	}
+	expect(GetNextAvailRes(&id, &nr, &qids), EC_NO_AVAIL_RES,
+	       "GetNextAvailRes", 2 * NR_DOCS);
+	for (i = 0; i < NR_DOCS; i++) {
+		if (nr_res[2 * i] != nr_res[2 * i + 1]
+		    || (nr_res[2 * i] > 0
+			&& memcmp(res[2 * i], res[2 * i + 1],
+				  sizeof(QueryID) * nr_res[2 * i]) != 0)) {
+			fprintf(stderr, "doc %d: %u results streamed, %u "
+				"whole\n", i, nr_res[2 * i + 1],
+				nr_res[2 * i]);
+			errors++;
+		}
+		if (i < NR_CHECKED)
+			brute_match(2 * i, docs[i]);
+		matched += nr_res[2 * i] > 0;
+		free(res[2 * i]);
+		free(res[2 * i + 1]);
+	}
+	printf("%d of %d documents matched queries\n", matched, NR_DOCS);
+}
+
+/* results are there while a document is still open, and do not wait on it */
+static void test_open_drain()
+{
+	DocID id = 0;
+	unsigned int nr = 0;
+	QueryID *qids = NULL;
+	char doc[] = "hello world";
+
+	puts("testing results while a document is open");
+	expect(BeginDocument(3 * NR_DOCS), EC_SUCCESS, "BeginDocument",
+	       3 * NR_DOCS);
+	expect(AppendDocumentChunk(3 * NR_DOCS, "hel", 3), EC_SUCCESS,
+	       "AppendDocumentChunk", 3 * NR_DOCS);
+	expect(MatchDocument(3 * NR_DOCS + 1, doc), EC_SUCCESS,
+	       "MatchDocument", 3 * NR_DOCS + 1);
+	expect(GetNextAvailRes(&id, &nr, &qids), EC_SUCCESS,
+	       "GetNextAvailRes", 3 * NR_DOCS + 1);
+	if (id != 3 * NR_DOCS + 1) {
+		fprintf(stderr, "got document %u while %d is open\n", id,
+			3 * NR_DOCS);
+		errors++;
+	}
+	if (nr > 0)
+		free(qids);
+	expect(GetNextAvailRes(&id, &nr, &qids), EC_NO_AVAIL_RES,
+	       "GetNextAvailRes", 3 * NR_DOCS);
+	expect(AppendDocumentChunk(3 * NR_DOCS, "lo world", 8), EC_SUCCESS,
+	       "AppendDocumentChunk", 3 * NR_DOCS);
+	expect(EndDocument(3 * NR_DOCS), EC_SUCCESS, "EndDocument",
+	       3 * NR_DOCS);
+	expect(GetNextAvailRes(&id, &nr, &qids), EC_SUCCESS,
+	       "GetNextAvailRes", 3 * NR_DOCS);
+	if (nr > 0)
+		free(qids);
+}
+
+int main(int argc, char *argv[])
+{
+	IndexConfig config;
+
+	/* a single worker unless told otherwise, so that open documents
+	 * would starve the others if they held it; whole documents queue up
+	 * behind the streamed ones and are matched in batches */
+	memset(&config, 0, sizeof(config));
+	config.num_workers = argc > 1 ? atoi(argv[1]) : 1;
+	config.batch_docs = argc > 2 ? atoi(argv[2]) : 8;
+	srand(time(NULL));
+	InitializeIndexWithConfig(&config);
+	test_stream();
+	test_open_drain();
+	DestroyIndex();
+	if (errors > 0)
+		fprintf(stderr, "%d errors\n", errors);
+	return errors != 0;
+}
@@ -1,6 +1,10 @@
 #include <limits.h>
 #include <string.h>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "util.h"
 #include "core.h"
 #include "misc.h"
@@ -57,6 +61,65 @@ int EditDistance(const char* a, int na, const char* b, int nb, int curr_dist)
 	return ret;
 }
 
+void BitPatternInit(struct bitpattern *pat, const char *word, int len)
+{
+	int i = 0;
+	memset(pat->peq, 0, sizeof(pat->peq));
+	for (i = 0; i < len; i++)
+		pat->peq[word[i] - 'a'] |= 1u << i;
+	pat->len = len;
+}
+
+/**
+ * global (not semi-global) variant: the top row of the DP grows by one in
+ * every column, hence the `| 1` when shifting the horizontal deltas.
+ *
+ * the last row can change by at most one per remaining text character, so
+ * `score - remaining` is a lower bound of the final distance and lets us keep
+ * the early-abandon contract of EditDistance().
+ */
+int EditDistanceBitParallel(const struct bitpattern *pat, const char *text,
+			    int n, int curr_dist)
+{
+	u32 pv = ~0u, mv = 0;
+	u32 eq, xv, xh, ph, mh;
+	u32 high = 1u << (pat->len - 1);
+	int score = pat->len;
+	int j = 0;
+
+	if (n - pat->len >= curr_dist || pat->len - n >= curr_dist)
+		return MAX_DIST + 1;
+
+	for (j = 0; j < n; j++) {
+		eq = pat->peq[text[j] - 'a'];
+		xv = eq | mv;
+		xh = (((eq & pv) + pv) ^ pv) | eq;
+		ph = mv | ~(xh | pv);
+		mh = pv & xh;
+		if (ph & high)
+			score++;
+		else if (mh & high)
+			score--;
+		ph = (ph << 1) | 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		if (score - (n - j - 1) >= curr_dist)
+			return MAX_DIST + 1;
+	}
+	return score;
+}
+
+/* letter counts of a word, see CharSigBound() */
+void CharSigInit(struct charsig *sig, const char *word, int len)
+{
+	int i = 0;
+
+	memset(sig, 0, sizeof(struct charsig));
+	for (i = 0; i < len; i++)
+		sig->cnt[word[i] - 'a']++;
+}
+
 /**
  * Computes Hamming distance between a null-terminated string "a" with length "na"
  * and a null-terminated string "b" with length "nb"
@@ -73,3 +136,242 @@ unsigned int HammingDistance(const char* a, int na, const char* b, int nb,
 	}
 	return num_mismatches;
 }
+
+/* number of mismatching bytes between two 8 byte lanes */
+static inline int mismatch_u64(u64 a, u64 b)
+{
+	const u64 low7 = 0x7f7f7f7f7f7f7f7fULL;
+	u64 x = a ^ b;
+	/* the high bit of each byte is set iff that byte is non-zero */
+	u64 y = ((x & low7) + low7) | x;
+	return __builtin_popcountll(y & ~low7);
+}
+
+static inline int hamming_scalar(const word_t a, const word_t b)
+{
+	const u64 *p = (const u64 *) a;
+	const u64 *q = (const u64 *) b;
+	return mismatch_u64(p[0], q[0]) + mismatch_u64(p[1], q[1])
+		+ mismatch_u64(p[2], q[2]) + mismatch_u64(p[3], q[3]);
+}
+
+/* bit i set iff doc[i] is not a space, for a full 64 byte block */
+static inline u64 word_mask64(const char *doc)
+{
+#if defined(__AVX2__)
+	__m256i space = _mm256_set1_epi8(' ');
+	u32 lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		_mm256_loadu_si256((const __m256i *) doc), space));
+	u32 hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		_mm256_loadu_si256((const __m256i *) (doc + 32)), space));
+	return ~(((u64) hi << 32) | lo);
+#elif defined(__SSE2__)
+	__m128i space = _mm_set1_epi8(' ');
+	u64 mask = 0;
+	int i = 0;
+	for (i = 0; i < 4; i++) {
+		u32 m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (doc + 16 * i)),
+			space));
+		mask |= (u64) m << (16 * i);
+	}
+	return ~mask;
+#else
+	u64 mask = 0;
+	int i = 0;
+	for (i = 0; i < 64; i++)
+		mask |= (u64) (doc[i] != ' ') << i;
+	return mask;
+#endif
+}
+
+/**
+ * word starts are the set bits of the mask whose predecessor is clear, word
+ * ends the clear bits whose predecessor is set; `carry` is the last bit of
+ * the previous block. they alternate, so one walk over both in address
+ * order pairs them up.
+ */
+int Tokenize(const char *doc, int len, u32 *offsets, u8 *lens)
+{
+	u64 carry = 0;
+	u32 start = 0;
+	int num = 0;
+	int base = 0;
+
+	for (base = 0; base < len; base += 64) {
+		u64 mask = 0, edges = 0;
+		if (base + 64 <= len) {
+			mask = word_mask64(doc + base);
+		} else {
+			int i = 0;
+			for (i = 0; base + i < len; i++)
+				mask |= (u64) (doc[base + i] != ' ') << i;
+		}
+		edges = mask ^ ((mask << 1) | carry);
+		while (edges) {
+			int bit = __builtin_ctzll(edges);
+			u32 pos = base + bit;
+			if (mask & (1ULL << bit)) {
+				start = pos;
+			} else {
+				offsets[num] = start;
+				lens[num++] = pos - start;
+			}
+			edges &= edges - 1;
+		}
+		carry = mask >> 63;
+	}
+	if (carry) {
+		offsets[num] = start;
+		lens[num++] = len - start;
+	}
+	return num;
+}
+
+/**
+ * both sides are zero-padded to sizeof(word_t) and have the same length, so
+ * the padding never mismatches and a full 32-byte compare gives the distance.
+ */
+int HammingDistanceBlock(const word_t *words, int num, const char *word,
+			 int lower_bound, int upper_bound)
+{
+	int ret = upper_bound;
+	int i = 0;
+	int dist = 0;
+
+	if (ret <= lower_bound)
+		return ret;
+#if defined(__AVX512BW__)
+	{
+		__m512i w = _mm512_broadcast_i64x4(
+			_mm256_loadu_si256((const __m256i *) word));
+		for (; i + 2 <= num; i += 2) {
+			__m512i d = _mm512_loadu_si512((const void *) words[i]);
+			u64 eq = _mm512_cmpeq_epi8_mask(w, d);
+			int d0 = 32 - __builtin_popcount((u32) eq);
+			int d1 = 32 - __builtin_popcount((u32) (eq >> 32));
+			dist = d0 < d1 ? d0 : d1;
+			if (dist < ret) {
+				ret = dist;
+				if (ret <= lower_bound)
+					return ret;
+			}
+		}
+	}
+#endif
+#if defined(__AVX2__)
+	{
+		__m256i w = _mm256_loadu_si256((const __m256i *) word);
+		for (; i < num; i++) {
+			__m256i d = _mm256_load_si256((const __m256i *) words[i]);
+			u32 eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(w, d));
+			dist = 32 - __builtin_popcount(eq);
+			if (dist < ret) {
+				ret = dist;
+				if (ret <= lower_bound)
+					return ret;
+			}
+		}
+	}
+#endif
+	for (; i < num; i++) {
+		dist = hamming_scalar(words[i], word);
+		if (dist < ret) {
+			ret = dist;
+			if (ret <= lower_bound)
+				return ret;
+		}
+	}
+	return ret;
+}
+
+/*
+ * the batch kernels are written with gcc vector extensions, so they are
+ * lowered to whatever SIMD width -march provides (one zmm, two ymm, four xmm).
+ */
+typedef u8 v16u8 __attribute__((vector_size(BATCH_LANES)));
+typedef u32 v16u32 __attribute__((vector_size(BATCH_LANES * 4)));
+
+void WordBatchInit(struct wordbatch *b, int len)
+{
+	memset(b->chars, 0, sizeof(b->chars));
+	memset(b->peq, 0, sizeof(b->peq));
+	b->len = len;
+}
+
+void WordBatchSetLane(struct wordbatch *b, int lane, const char *word)
+{
+	int i = 0;
+	WordBatchClearLane(b, lane);
+	for (i = 0; i < b->len; i++) {
+		b->chars[i][lane] = word[i];
+		b->peq[word[i] - 'a'][lane] |= 1u << i;
+	}
+}
+
+void WordBatchClearLane(struct wordbatch *b, int lane)
+{
+	int i = 0;
+	for (i = 0; i < MAX_WORD_LENGTH; i++)
+		b->chars[i][lane] = 0;
+	for (i = 0; i < 26; i++)
+		b->peq[i][lane] = 0;
+}
+
+void HammingDistanceBatch(const struct wordbatch *b, const word_t *words,
+			  int num, u8 *min_dist)
+{
+	const v16u8 zero = {0};
+	v16u8 best, dist, chars, mask;
+	int i = 0, p = 0;
+
+	memcpy(&best, min_dist, sizeof(best));
+	for (i = 0; i < num; i++) {
+		dist = zero;
+		for (p = 0; p < b->len; p++) {
+			memcpy(&chars, b->chars[p], sizeof(chars));
+			/* a true compare is -1 in every bit of the lane */
+			dist -= (v16u8) (chars != (u8) words[i][p]);
+		}
+		mask = (v16u8) (dist < best);
+		best = (dist & mask) | (best & ~mask);
+	}
+	memcpy(min_dist, &best, sizeof(best));
+}
+
+/* the lane-wise version of EditDistanceBitParallel() */
+void EditDistanceBatch(const struct wordbatch *b, const word_t *words,
+		       int num, int n, u8 *min_dist)
+{
+	const v16u32 zero = {0};
+	const v16u32 high = zero + (1u << (b->len - 1));
+	v16u32 pv, mv, eq, xv, xh, ph, mh, score, mask;
+	v16u32 best = zero;
+	int i = 0, j = 0;
+
+	for (i = 0; i < BATCH_LANES; i++)
+		best[i] = min_dist[i];
+	for (i = 0; i < num; i++) {
+		const char *text = words[i];
+		pv = ~zero;
+		mv = zero;
+		score = zero + b->len;
+		for (j = 0; j < n; j++) {
+			memcpy(&eq, b->peq[text[j] - 'a'], sizeof(eq));
+			xv = eq | mv;
+			xh = (((eq & pv) + pv) ^ pv) | eq;
+			ph = mv | ~(xh | pv);
+			mh = pv & xh;
+			score -= (v16u32) ((ph & high) != 0);
+			score += (v16u32) ((mh & high) != 0);
+			ph = (ph << 1) | 1;
+			mh <<= 1;
+			pv = mh | ~(xv | ph);
+			mv = ph & xv;
+		}
+		mask = (v16u32) (score < best);
+		best = (score & mask) | (best & ~mask);
+	}
+	for (i = 0; i < BATCH_LANES; i++)
+		min_dist[i] = best[i];
+}
@@ -3,9 +3,108 @@
 
 #include "misc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 int EditDistance(const char* a, int na, const char* b, int nb, int k);
 
+/**
+ * pattern match masks (Peq) of a word, one bit per position for each letter.
+ * MAX_WORD_LENGTH is 31, so every word fits in a single machine word.
+ */
+struct bitpattern {
+	u32 peq[26];
+	int len;
+};
+
+void BitPatternInit(struct bitpattern *pat, const char *word, int len);
+
+/**
+ * Myers/Hyyro bit-vector edit distance between the pattern and `text`.
+ * returns MAX_DIST + 1 as soon as the distance cannot be below curr_dist.
+ */
+int EditDistanceBitParallel(const struct bitpattern *pat, const char *text,
+			    int n, int curr_dist);
+
 unsigned int HammingDistance(const char* a, int na, const char* b, int nb,
 			     int cur_dist);
 
+/**
+ * minimum hamming distance between `word` and a block of `num` packed,
+ * zero-padded words of the same length. `words` must be 32 bytes aligned.
+ * stops as soon as a distance <= lower_bound is found.
+ */
+int HammingDistanceBlock(const word_t *words, int num, const char *word,
+			 int lower_bound, int upper_bound);
+
+/**
+ * letter counts of a word. a substitution moves the L1 distance of two
+ * signatures by at most 2 and the length difference by 0, an indel moves
+ * both by 1, so (L1 + |na - nb|) / 2 rounded up bounds the edit distance.
+ */
+struct charsig {
+	u8 cnt[32];
+} __attribute__((aligned(32)));
+
+void CharSigInit(struct charsig *sig, const char *word, int len);
+
+static inline int CharSigBound(const struct charsig *a, int na,
+			       const struct charsig *b, int nb)
+{
+	int l1 = 0;
+	int dlen = na > nb ? na - nb : nb - na;
+#ifdef __SSE2__
+	const __m128i *pa = (const __m128i *) a->cnt;
+	const __m128i *pb = (const __m128i *) b->cnt;
+	__m128i lo = _mm_or_si128(_mm_subs_epu8(pa[0], pb[0]),
+				  _mm_subs_epu8(pb[0], pa[0]));
+	__m128i hi = _mm_or_si128(_mm_subs_epu8(pa[1], pb[1]),
+				  _mm_subs_epu8(pb[1], pa[1]));
+	__m128i sad = _mm_add_epi64(_mm_sad_epu8(lo, _mm_setzero_si128()),
+				    _mm_sad_epu8(hi, _mm_setzero_si128()));
+	l1 = _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+#else
+	int i = 0;
+	for (i = 0; i < 26; i++)
+		l1 += a->cnt[i] > b->cnt[i] ? a->cnt[i] - b->cnt[i]
+					    : b->cnt[i] - a->cnt[i];
+#endif
+	return (l1 + dlen + 1) >> 1;
+}
+
+/**
+ * split `len` bytes of space separated words into (offset, length) pairs, 64
+ * bytes at a time. returns the number of words; `offsets` and `lens` need
+ * room for len / 2 + 1 of them.
+ */
+int Tokenize(const char *doc, int len, u32 *offsets, u8 *lens);
+
+/* number of operator words evaluated together by the batch kernels */
+#define BATCH_LANES 16
+
+/**
+ * a batch of same-length words transposed into SIMD lanes: chars[p] holds the
+ * p-th character of every lane, peq[c] the pattern mask of letter c of every
+ * lane.
+ */
+struct wordbatch {
+	u8 chars[MAX_WORD_LENGTH][BATCH_LANES];
+	u32 peq[26][BATCH_LANES];
+	int len;
+};
+
+void WordBatchInit(struct wordbatch *b, int len);
+void WordBatchSetLane(struct wordbatch *b, int lane, const char *word);
+void WordBatchClearLane(struct wordbatch *b, int lane);
+
+/**
+ * stream `num` packed doc words through every lane of the batch at once and
+ * lower min_dist[lane] to the smallest distance seen in that lane.
+ */
+void HammingDistanceBatch(const struct wordbatch *b, const word_t *words,
+			  int num, u8 *min_dist);
+void EditDistanceBatch(const struct wordbatch *b, const word_t *words,
+		       int num, int n, u8 *min_dist);
+
 #endif /* _UTIL_H_ */
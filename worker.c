@@ -1,86 +1,623 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
 #include "worker.h"
 
 
 extern void free_match_obj(void *ptr);
 
-static void *worker_routine(void *arg)
+static void doc_ring_init(struct doc_ring *ring)
+{
+	unsigned long i = 0;
+	for (i = 0; i < DOC_RING_SIZE; i++)
+		ring->cells[i].seq = i;
+	ring->head = ring->tail = 0;
+}
+
+/* returns 0 when the ring is full */
+static int doc_ring_push(struct doc_ring *ring, struct document_match *match)
+{
+	unsigned long pos = ring->tail;
+	for (;;) {
+		struct doc_ring_cell *cell = &ring->cells[pos & (DOC_RING_SIZE - 1)];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long diff = (long) (seq - pos);
+		if (diff == 0) {
+			if (cmpxchg(&ring->tail, pos, pos + 1) == pos) {
+				cell->match = match;
+				__atomic_store_n(&cell->seq, pos + 1,
+						 __ATOMIC_RELEASE);
+				return 1;
+			}
+		} else if (diff < 0) {
+			return 0;
+		}
+		pos = ring->tail;
+	}
+}
+
+/* returns NULL when the ring is empty */
+static struct document_match *doc_ring_pop(struct doc_ring *ring)
+{
+	unsigned long pos = ring->head;
+	for (;;) {
+		struct doc_ring_cell *cell = &ring->cells[pos & (DOC_RING_SIZE - 1)];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long diff = (long) (seq - (pos + 1));
+		if (diff == 0) {
+			if (cmpxchg(&ring->head, pos, pos + 1) == pos) {
+				struct document_match *match = cell->match;
+				__atomic_store_n(&cell->seq,
+						 pos + DOC_RING_SIZE,
+						 __ATOMIC_RELEASE);
+				return match;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		}
+		pos = ring->head;
+	}
+}
+
+static inline int doc_ring_empty(struct doc_ring *ring)
+{
+	return ring->head == ring->tail;
+}
+
+static void futex_wait(volatile int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(volatile int *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+/* wake up to `nr` parked workers, the caller has published its work */
+static void worker_manager_wake(struct worker_manager *mgr, int nr)
+{
+	/* pairs with the nr_parked increment in worker_manager_park() */
+	__sync_synchronize();
+	if (mgr->nr_parked == 0)
+		return;
+	__sync_fetch_and_add(&mgr->wake_seq, 1);
+	futex_wake(&mgr->wake_seq, nr);
+}
+
+/**
+ * sleep until something is pushed or offered. a pusher that misses our
+ * nr_parked increment has published before our last look at the ring, one
+ * that sees it moves wake_seq and the wait returns at once. tasks that are
+ * out already do not keep us up, their owner takes back what nobody
+ * steals; only worker_manager_share() wakes thieves.
+ */
+static void worker_manager_park(struct worker_manager *mgr)
+{
+	int seq = 0;
+
+	__sync_fetch_and_add(&mgr->nr_parked, 1);
+	seq = mgr->wake_seq;
+	if (doc_ring_empty(&mgr->doc_ring))
+		futex_wait(&mgr->wake_seq, seq);
+	__sync_fetch_and_sub(&mgr->nr_parked, 1);
+}
+
+static void result_ring_init(struct result_ring *ring)
+{
+	memset(ring, 0, sizeof(struct result_ring));
+	ring->tail_seg = calloc(1, sizeof(struct result_seg));
+	ring->head_seg = ring->tail_seg;
+}
+
+static void result_ring_push(struct result_ring *ring,
+			     struct match_result *result)
+{
+	if (ring->tail_pos == RESULT_SEG_SIZE) {
+		struct result_seg *seg =
+			__sync_lock_test_and_set(&ring->spare, NULL);
+		if (seg == NULL)
+			seg = malloc(sizeof(struct result_seg));
+		seg->next = NULL;
+		ring->tail_seg->next = seg;
+		ring->tail_seg = seg;
+		ring->tail_pos = 0;
+	}
+	ring->tail_seg->slots[ring->tail_pos++] = result;
+	__atomic_store_n(&ring->nr_pushed, ring->nr_pushed + 1,
+			 __ATOMIC_RELEASE);
+}
+
+static struct match_result *result_ring_pop(struct result_ring *ring)
+{
+	struct match_result *result = NULL;
+
+	if (ring->nr_popped == __atomic_load_n(&ring->nr_pushed,
+					       __ATOMIC_ACQUIRE))
+		return NULL;
+	if (ring->head_pos == RESULT_SEG_SIZE) {
+		/* the worker linked the next one before publishing into it */
+		struct result_seg *seg = ring->head_seg;
+		ring->head_seg = seg->next;
+		ring->head_pos = 0;
+		seg = __sync_lock_test_and_set(&ring->spare, seg);
+		free(seg);
+	}
+	result = ring->head_seg->slots[ring->head_pos++];
+	ring->nr_popped++;
+	return result;
+}
+
+static struct task_array *task_array_new(long size)
+{
+	struct task_array *array = malloc(sizeof(struct task_array)
+					  + size * sizeof(struct match_task *));
+	array->size = size;
+	array->prev = NULL;
+	return array;
+}
+
+static void task_deque_init(struct task_deque *deque)
+{
+	deque->top = deque->bottom = 0;
+	deque->array = task_array_new(TASK_DEQUE_SIZE);
+}
+
+/* owner only */
+static void task_deque_push(struct task_deque *deque, struct match_task *task)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	struct task_array *array = deque->array;
+
+	if (b - t > array->size - 1) {
+		struct task_array *bigger = task_array_new(array->size * 2);
+		long i = 0;
+		for (i = t; i < b; i++)
+			bigger->slots[i & (bigger->size - 1)] =
+				array->slots[i & (array->size - 1)];
+		bigger->prev = array;
+		__atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+		array = bigger;
+	}
+	array->slots[b & (array->size - 1)] = task;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/* owner only, NULL when empty */
+static struct match_task *task_deque_take(struct task_deque *deque)
+{
+	long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	struct task_array *array = deque->array;
+	struct match_task *task = NULL;
+	long t = 0;
+
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		task = array->slots[b & (array->size - 1)];
+		if (t == b) {
+			/* the last one, a thief may be after it too */
+			if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1,
+							 0, __ATOMIC_SEQ_CST,
+							 __ATOMIC_RELAXED))
+				task = NULL;
+			__atomic_store_n(&deque->bottom, b + 1,
+					 __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/* any thread, NULL when empty or when another thief won */
+static struct match_task *task_deque_steal(struct task_deque *deque)
+{
+	long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	struct match_task *task = NULL;
+	struct task_array *array = NULL;
+	long b = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+	task = array->slots[t & (array->size - 1)];
+	if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return task;
+}
+
+/* one round over the other workers' deques, from a random one */
+static struct match_task *worker_steal(struct worker *worker)
 {
-	struct worker* worker = arg;
 	struct worker_manager *mgr = worker->mgr;
+	int i = 0, start = rand_r(&worker->seed) % mgr->nr_workers;
+
+	for (i = 0; i < mgr->nr_workers; i++) {
+		struct worker *victim =
+			&mgr->workers[(start + i) % mgr->nr_workers];
+		struct match_task *task = NULL;
+		if (victim == worker)
+			continue;
+		task = task_deque_steal(&victim->tasks);
+		if (task != NULL)
+			return task;
+	}
+	return NULL;
+}
+
+/* a stolen task is done, wake its owner if it waits for the last one */
+static void worker_manager_task_done(struct worker_manager *mgr,
+				     struct match_task *task)
+{
+	/* the job may be gone once nr_tasks drops, its owner stays */
+	struct worker *owner = &mgr->workers[task->job->match->shadow_id];
+
+	if (__sync_sub_and_fetch(&task->job->nr_tasks, 1) == 0
+	    && owner->unshare_waiting) {
+		__sync_fetch_and_add(&owner->unshare_seq, 1);
+		futex_wake(&owner->unshare_seq, 1);
+	}
+}
+
+/**
+ * how many documents to match together: an equal share of the queue with
+ * the idle workers that have a cpu to run on, at most batch_docs.
+ */
+static int worker_batch_size(struct worker_manager *mgr)
+{
+	long queued = mgr->doc_ring.tail - mgr->doc_ring.head;
+	int others = mgr->nr_cpus - (mgr->nr_workers - mgr->nr_idle);
+	long nr = 0;
+
+	if (others > mgr->nr_idle)
+		others = mgr->nr_idle;
+	if (others < 0)
+		others = 0;
+	nr = 1 + (queued > 0 ? queued : 0) / (others + 1);
+	return nr < mgr->batch_docs ? nr : mgr->batch_docs;
+}
+
+/* more queued documents for a batch starting with batch[0] */
+static int worker_gather(struct worker_manager *mgr,
+			 struct document_match **batch)
+{
+	int nr = 1, want = worker_batch_size(mgr);
 	struct document_match *match = NULL;
-	struct match_result *result = NULL;
 
-process:
-	pthread_mutex_lock(&mgr->doc_mutex);
-	while (list_empty(&mgr->doc_queue)) {
-		pthread_cond_wait(&mgr->doc_cond, &mgr->doc_mutex);
+	while (nr < want && (match = doc_ring_pop(&mgr->doc_ring)) != NULL) {
+		if (match->stream != NULL) {
+			/* it has chunks to feed, hand it on */
+			while (!doc_ring_push(&mgr->doc_ring, match))
+				sched_yield();
+			worker_manager_wake(mgr, 1);
+			break;
+		}
+		batch[nr++] = match;
+	}
+	return nr;
+}
+
+/* room was handed back, wake a submitter waiting for it */
+static void worker_manager_wake_admit(struct worker_manager *mgr)
+{
+	/* pairs with admit_waiting in worker_manager_admit() */
+	__sync_synchronize();
+	if (mgr->admit_waiting) {
+		__sync_fetch_and_add(&mgr->admit_seq, 1);
+		futex_wake(&mgr->admit_seq, 1);
 	}
-	match = container_of(mgr->doc_queue.prev, struct document_match, head);
-	list_del(&match->head);
-	pthread_mutex_unlock(&mgr->doc_mutex);
+}
+
+static void worker_publish(struct worker *worker,
+			   struct document_match *match,
+			   struct match_result *result)
+{
+	struct worker_manager *mgr = worker->mgr;
 
-	result = malloc(sizeof(struct match_result));
-	match_exec(match, result, worker->shadow_id);
 	result->doc_id = match->doc_id;
 	free_match_obj(match);
-
-	pthread_mutex_lock(&mgr->result_mutex);
-	list_add(&result->head, &mgr->result_queue);
-	pthread_cond_signal(&mgr->result_cond);
+	result_ring_push(&worker->results, result);
 	__sync_fetch_and_sub(&mgr->nr_pending, 1);
-	pthread_mutex_unlock(&mgr->result_mutex);
+	/* pairs with result_waiting in worker_manager_pop() */
+	__sync_synchronize();
+	if (mgr->result_waiting) {
+		__sync_fetch_and_add(&mgr->result_seq, 1);
+		futex_wake(&mgr->result_seq, 1);
+	}
+	worker_manager_wake_admit(mgr);
+}
+
+static void *worker_routine(void *arg)
+{
+	struct worker* worker = arg;
+	struct worker_manager *mgr = worker->mgr;
+	struct document_match *match = NULL;
+	struct document_match *batch[DOC_BATCH_MAX];
+	struct match_result *results[DOC_BATCH_MAX];
+	struct match_task *task = NULL;
+	int spins = 0, nr = 0, i = 0;
+
+	plan_init_shadow(plan_get(), worker->shadow_id);
+	__sync_fetch_and_add(&mgr->nr_started, 1);
+process:
+	__sync_fetch_and_add(&mgr->nr_idle, 1);
+	for (spins = 0; ; spins++) {
+		/* new documents come first, stealing only shortens one */
+		match = doc_ring_pop(&mgr->doc_ring);
+		if (match != NULL)
+			break;
+		if (mgr->nr_jobs > 0 && (task = worker_steal(worker)) != NULL) {
+			__sync_fetch_and_sub(&mgr->nr_idle, 1);
+			match_run_task(task);
+			worker_manager_task_done(mgr, task);
+			goto process;
+		}
+		if (spins < DOC_SPIN) {
+			cpu_relax();
+			continue;
+		}
+		worker_manager_park(mgr);
+		spins = 0;
+	}
+	__sync_fetch_and_sub(&mgr->nr_idle, 1);
+	/* an open document comes back with its next chunks */
+	if (match->stream != NULL && !match_stream_feed(match, mgr))
+		goto process;
+
+	batch[0] = match;
+	nr = 1;
+	if (mgr->batch_docs > 1 && match->stream == NULL)
+		nr = worker_gather(mgr, batch);
+	for (i = 0; i < nr; i++)
+		results[i] = malloc(sizeof(struct match_result));
+	if (nr == 1)
+		match_exec(match, results[0], worker->shadow_id, mgr);
+	else
+		match_exec_batch(batch, results, nr, worker->shadow_id, mgr);
+	for (i = 0; i < nr; i++)
+		worker_publish(worker, batch[i], results[i]);
 	goto process;
 
 	return NULL;
 }
 
-void worker_manager_init(struct worker_manager *mgr)
+/* `affinity` has an entry per worker, or is NULL for no pinning */
+void worker_manager_init(struct worker_manager *mgr, int nr_workers,
+			 const struct worker_affinity *affinity,
+			 int batch_docs, long max_pending, long max_bytes)
 {
-	int i = 0;
+	int i = 0, j = 0, pinned = 0;
+	pthread_attr_t attr;
+	cpu_set_t set;
 
-	pthread_mutex_init(&mgr->doc_mutex, NULL);
-	pthread_cond_init(&mgr->doc_cond, NULL);
-	list_init(&mgr->doc_queue);
-	pthread_mutex_init(&mgr->result_mutex, NULL);
-	pthread_cond_init(&mgr->result_cond, NULL);
-	list_init(&mgr->result_queue);
+	doc_ring_init(&mgr->doc_ring);
+	mgr->wake_seq = 0;
+	mgr->nr_parked = 0;
+	mgr->nr_idle = 0;
+	mgr->nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	mgr->nr_jobs = 0;
+	mgr->result_seq = 0;
+	mgr->result_waiting = 0;
+	mgr->next_ring = 0;
 	mgr->nr_pending = 0;
+	mgr->nr_bytes = 0;
+	mgr->max_pending = max_pending;
+	mgr->max_bytes = max_bytes;
+	mgr->admit_seq = 0;
+	mgr->admit_waiting = 0;
+	mgr->nr_workers = nr_workers;
+	mgr->batch_docs = batch_docs;
+	mgr->nr_started = 0;
+	if (posix_memalign((void **) &mgr->workers, 64,
+			   nr_workers * sizeof(struct worker)))
+		abort();
 
 	/* creating worker threads */
-	for (i = 0; i < NR_SHADOW; i++) {
+	for (i = 0; i < nr_workers; i++) {
 		struct worker *worker = &mgr->workers[i];
 		worker->shadow_id = i;
 		worker->mgr = mgr;
-		pthread_create(&worker->id, NULL, worker_routine, worker);
+		worker->seed = i + 1;
+		task_deque_init(&worker->tasks);
+		worker->unshare_seq = 0;
+		worker->unshare_waiting = 0;
+		result_ring_init(&worker->results);
+		pthread_attr_init(&attr);
+		pinned = affinity != NULL && affinity[i].nr_cpus > 0;
+		if (pinned) {
+			CPU_ZERO(&set);
+			for (j = 0; j < affinity[i].nr_cpus; j++)
+				CPU_SET(affinity[i].cpus[j], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		if (pthread_create(&worker->id, &attr, worker_routine, worker)
+		    && pinned) {
+			/* the cores are offline or outside our cpuset */
+			fprintf(stderr, "worker %d: cannot run on cpu %d%s\n",
+				i, affinity[i].cpus[0],
+				affinity[i].nr_cpus > 1 ? "..." : "");
+			pthread_create(&worker->id, NULL, worker_routine,
+				       worker);
+		}
+		pthread_attr_destroy(&attr);
 	}
+	/* the per-shadow memory is first touched by its worker, so it
+	 * lands on the worker's node; wait until it is all there */
+	while (mgr->nr_started < nr_workers)
+		sched_yield();
 }
 
 void worker_manager_push(struct worker_manager *mgr,
 			 struct document_match *match)
 {
-	pthread_mutex_lock(&mgr->doc_mutex);
-	list_add(&match->head, &mgr->doc_queue);
-	pthread_cond_signal(&mgr->doc_cond);
-	__sync_fetch_and_add(&mgr->nr_pending, 1);
-	pthread_mutex_unlock(&mgr->doc_mutex);
+	/* admitted documents fit in the ring and an open document is on it
+	 * at most once, so this does not really spin */
+	while (!doc_ring_push(&mgr->doc_ring, match))
+		sched_yield();
+	worker_manager_wake(mgr, 1);
 }
 
-struct match_result *worker_manager_pop(struct worker_manager *mgr)
+static int worker_manager_fits(struct worker_manager *mgr, int nr_docs,
+			       long bytes)
 {
-	struct match_result *result = NULL;
-	pthread_mutex_lock(&mgr->result_mutex);
-	while (list_empty(&mgr->result_queue)) {
-		if (mgr->nr_pending == 0) {
-			pthread_mutex_unlock(&mgr->result_mutex);
-			return NULL;
+	if (mgr->nr_pending + nr_docs > mgr->max_pending)
+		return 0;
+	/* a document larger than the whole budget goes in on its own */
+	return mgr->max_bytes == 0 || mgr->nr_bytes == 0
+		|| mgr->nr_bytes + bytes <= mgr->max_bytes;
+}
+
+/**
+ * reserve room for `nr_docs` documents holding `bytes` of buffers, see
+ * ADMIT_*. there is a single submitter, so room seen here cannot be taken
+ * by anybody else.
+ */
+int worker_manager_admit(struct worker_manager *mgr, int nr_docs,
+			 long bytes, int mode)
+{
+	int seq = 0;
+
+	while (!worker_manager_fits(mgr, nr_docs, bytes)) {
+		if (mode == ADMIT_TRY)
+			return 0;
+		mgr->admit_waiting = 1;
+		__sync_synchronize();
+		seq = mgr->admit_seq;
+		if (!worker_manager_fits(mgr, nr_docs, bytes))
+			futex_wait(&mgr->admit_seq, seq);
+		mgr->admit_waiting = 0;
+	}
+	__sync_fetch_and_add(&mgr->nr_pending, nr_docs);
+	__sync_fetch_and_add(&mgr->nr_bytes, bytes);
+	return 1;
+}
+
+/* hand back what was admitted for documents that were not pushed */
+void worker_manager_unadmit(struct worker_manager *mgr, int nr_docs,
+			    long bytes)
+{
+	__sync_fetch_and_sub(&mgr->nr_pending, nr_docs);
+	__sync_fetch_and_sub(&mgr->nr_bytes, bytes);
+}
+
+/* a worker is done with `bytes` of document buffers */
+void worker_manager_unreserve(struct worker_manager *mgr, long bytes)
+{
+	if (bytes == 0)
+		return;
+	__sync_fetch_and_sub(&mgr->nr_bytes, bytes);
+	worker_manager_wake_admit(mgr);
+}
+
+/* one round over the rings, starting after the one served last */
+static struct match_result *worker_manager_poll(struct worker_manager *mgr)
+{
+	int i = 0;
+	for (i = 0; i < mgr->nr_workers; i++) {
+		int idx = (mgr->next_ring + i) % mgr->nr_workers;
+		struct match_result *result =
+			result_ring_pop(&mgr->workers[idx].results);
+		if (result != NULL) {
+			mgr->next_ring = (idx + 1) % mgr->nr_workers;
+			return result;
 		}
-		pthread_cond_wait(&mgr->result_cond, &mgr->result_mutex);
 	}
-	result = container_of(mgr->result_queue.prev, struct match_result,
-			      head);
-	list_del(&result->head);
-	pthread_mutex_unlock(&mgr->result_mutex);
+	return NULL;
+}
+
+/**
+ * a finished document, NULL once nothing is pending but the `nr_open`
+ * documents that cannot finish before the caller ends them. a worker
+ * publishes before it drops nr_pending, so the rings are polled once more
+ * after nr_pending is seen down to nr_open.
+ */
+struct match_result *worker_manager_pop(struct worker_manager *mgr,
+					long nr_open)
+{
+	struct match_result *result = NULL;
+	int seq = 0;
+
+	for (;;) {
+		result = worker_manager_poll(mgr);
+		if (result != NULL || mgr->nr_pending <= nr_open)
+			break;
+		mgr->result_waiting = 1;
+		__sync_synchronize();
+		seq = mgr->result_seq;
+		result = worker_manager_poll(mgr);
+		if (result == NULL && mgr->nr_pending > nr_open)
+			futex_wait(&mgr->result_seq, seq);
+		mgr->result_waiting = 0;
+		if (result != NULL)
+			break;
+	}
+	if (result == NULL)
+		result = worker_manager_poll(mgr);
 	return result;
 }
 
+/**
+ * how many parked workers a document may wake to steal from it: none while
+ * documents wait for them or when they would not get a cpu of their own.
+ */
+int worker_manager_nr_helpers(struct worker_manager *mgr)
+{
+	int nr = 0;
+
+	if (!doc_ring_empty(&mgr->doc_ring))
+		return 0;
+	nr = mgr->nr_cpus - (mgr->nr_workers - mgr->nr_idle);
+	if (nr > mgr->nr_idle)
+		nr = mgr->nr_idle;
+	if (nr > MATCH_SPLIT_MAX_HELPERS)
+		nr = MATCH_SPLIT_MAX_HELPERS;
+	return nr > 0 ? nr : 0;
+}
+
+/* push the `nr` tasks of `job` on the worker's deque, the last one first */
+void worker_manager_share(struct worker_manager *mgr, int shadow_id,
+			  struct match_job *job, int nr, int nr_helpers)
+{
+	struct task_deque *deque = &mgr->workers[shadow_id].tasks;
+	int i = 0;
+
+	job->nr_tasks = nr;
+	for (i = nr - 1; i >= 0; i--)
+		task_deque_push(deque, &job->tasks[i]);
+	__sync_fetch_and_add(&mgr->nr_jobs, 1);
+	worker_manager_wake(mgr, nr_helpers);
+}
+
+/* take back what was not stolen and wait for the thieves to finish */
+void worker_manager_unshare(struct worker_manager *mgr, int shadow_id,
+			    struct match_job *job)
+{
+	struct worker *worker = &mgr->workers[shadow_id];
+	int seq = 0;
+
+	job->done = 1;
+	while (task_deque_take(&worker->tasks) != NULL)
+		__sync_fetch_and_sub(&job->nr_tasks, 1);
+	__sync_fetch_and_sub(&mgr->nr_jobs, 1);
+	while (job->nr_tasks > 0) {
+		worker->unshare_waiting = 1;
+		/* pairs with the nr_tasks decrement of the last thief */
+		__sync_synchronize();
+		seq = worker->unshare_seq;
+		if (job->nr_tasks > 0)
+			futex_wait(&worker->unshare_seq, seq);
+		worker->unshare_waiting = 0;
+	}
+}
+
 /* destroy function? TBD....-_- */
@@ -9,31 +9,156 @@
 #include "operator.h"
 #include "match.h"
 
+/* slots of the document ring, also the most documents in flight */
+#define DOC_RING_SIZE 512
+/* default limit on documents in flight: per worker, and at least
+ * MATCH_POOL_MIN of them. the match pool holds that many objects */
+#define MATCH_POOL_PER_WORKER 2
+#define MATCH_POOL_MIN 48
+/* pause loops an idle worker spins on the ring before it parks */
+#define DOC_SPIN 128
+
+/**
+ * bounded multi-producer multi-consumer ring (vyukov): each cell carries a
+ * sequence number telling whose turn it is. a producer owns cell `pos` once
+ * seq == pos, a consumer once seq == pos + 1; claiming is one cas on tail or
+ * head, publishing is one release store of seq.
+ */
+struct doc_ring_cell {
+	volatile unsigned long seq;
+	struct document_match *match;
+};
+
+struct doc_ring {
+	struct doc_ring_cell cells[DOC_RING_SIZE];
+	volatile unsigned long head __attribute__((aligned(64)));
+	volatile unsigned long tail __attribute__((aligned(64)));
+};
+
+/* results per segment of a worker's result ring */
+#define RESULT_SEG_SIZE 256
+
+struct result_seg {
+	struct match_result *slots[RESULT_SEG_SIZE];
+	struct result_seg *next;
+};
+
+/**
+ * single producer (the worker) single consumer (GetNextAvailRes) queue of
+ * finished documents: a chain of segments, so the worker never waits for
+ * the consumer. the counters are the only shared words, a result is
+ * published by the release store of nr_pushed. a drained segment is handed
+ * back through `spare` for the next one the worker needs.
+ */
+struct result_ring {
+	/* worker side */
+	struct result_seg *tail_seg __attribute__((aligned(64)));
+	int tail_pos;
+	volatile unsigned long nr_pushed;
+	/* consumer side */
+	struct result_seg *head_seg __attribute__((aligned(64)));
+	int head_pos;
+	unsigned long nr_popped;
+	struct result_seg *volatile spare;
+};
+
+/* initial slots of a worker's task deque, it doubles when full */
+#define TASK_DEQUE_SIZE 256
+
+struct task_array {
+	long size; /* power of two */
+	struct task_array *prev; /* outgrown, freed with the deque */
+	struct match_task *slots[];
+};
+
+/**
+ * chase-lev work stealing deque. the owning worker pushes and takes at the
+ * bottom, thieves steal at the top with one cas on top, which is also how
+ * the owner settles a race for the last task. a full array is replaced by
+ * one twice the size; a thief may still be reading the old one, so it is
+ * kept until the deque goes away.
+ */
+struct task_deque {
+	volatile long top __attribute__((aligned(64)));
+	volatile long bottom __attribute__((aligned(64)));
+	struct task_array *volatile array;
+};
+
+/* the cpus a worker may run on, nr_cpus 0 for any */
+struct worker_affinity {
+	const int *cpus;
+	int nr_cpus;
+};
+
 struct worker {
 	pthread_t id;
 	struct worker_manager *mgr;
 	int shadow_id;
+	unsigned int seed; /* picks the first victim to steal from */
+	struct task_deque tasks;
+	/* the worker sleeps on unshare_seq until the thieves of its job are
+	 * done, the last one bumps it */
+	volatile int unshare_seq;
+	volatile int unshare_waiting;
+	struct result_ring results;
 };
 
 struct worker_manager {
-	pthread_mutex_t doc_mutex;
-	pthread_cond_t doc_cond;
-	struct list_head doc_queue;
+	struct doc_ring doc_ring;
+	/* idle workers sleep on wake_seq, it moves with every wake up */
+	volatile int wake_seq __attribute__((aligned(64)));
+	volatile int nr_parked;
+	volatile int nr_idle; /* workers looking for something to do */
+	int nr_cpus;
+	/* workers with tasks on their deque */
+	volatile int nr_jobs;
 
-	struct worker workers[NR_SHADOW];
+	struct worker *workers;
+	int nr_workers;
+	int batch_docs; /* most documents a worker matches together */
+	volatile int nr_started; /* workers done with plan_init_shadow() */
 
-	pthread_mutex_t result_mutex;
-	pthread_cond_t result_cond;
-	struct list_head result_queue;
+	/* eventcount of the consumer, bumped when a result lands while it
+	 * waits */
+	volatile int result_seq __attribute__((aligned(64)));
+	volatile int result_waiting;
+	int next_ring; /* round robin start of the next pop */
 
-	volatile long nr_pending;
+	/* admission: documents and document bytes in flight, and their
+	 * limits. the submitter sleeps on admit_seq while there is no room,
+	 * a worker bumps it when it hands room back */
+	volatile long nr_pending __attribute__((aligned(64)));
+	volatile long nr_bytes;
+	long max_pending;
+	long max_bytes; /* 0 for no limit */
+	volatile int admit_seq;
+	volatile int admit_waiting;
 };
 
-void worker_manager_init(struct worker_manager *mgr);
+void worker_manager_init(struct worker_manager *mgr, int nr_workers,
+			 const struct worker_affinity *affinity,
+			 int batch_docs, long max_pending, long max_bytes);
+
+/* what worker_manager_admit() does when there is no room */
+#define ADMIT_TRY 0 /* fail */
+#define ADMIT_WAIT 1 /* sleep until there is */
+
+int  worker_manager_admit(struct worker_manager *mgr, int nr_docs,
+			  long bytes, int mode);
+void worker_manager_unadmit(struct worker_manager *mgr, int nr_docs,
+			    long bytes);
+void worker_manager_unreserve(struct worker_manager *mgr, long bytes);
 
 void worker_manager_push(struct worker_manager *mgr,
 			 struct document_match *match);
 
-struct match_result *worker_manager_pop(struct worker_manager *mgr);
+struct match_result *worker_manager_pop(struct worker_manager *mgr,
+					long nr_open);
+
+int  worker_manager_nr_helpers(struct worker_manager *mgr);
+void worker_manager_share(struct worker_manager *mgr, int shadow_id,
+			  struct match_job *job, int nr, int nr_helpers);
+void worker_manager_unshare(struct worker_manager *mgr, int shadow_id,
+			    struct match_job *job);
 
 #endif /* _WORKER_H_ */